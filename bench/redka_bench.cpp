@@ -0,0 +1,431 @@
+// Microbenchmarks of the storage hot paths.
+//
+//   redka-bench [--sizes 1000,10000] [--filter get/] [--min-time 0.5] [--json] [--label <commit>] [--dir <path>]
+//
+// Each benchmark repeats its operation in growing batches until --min-time
+// seconds have passed. Benchmarks over a dataset run once per --sizes entry.
+// --json prints one document with every result, for comparing runs across
+// commits; the data files live in --dir (a fresh temporary directory by default).
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "compact.h"
+#include "mapped_file.h"
+#include "merge_records.h"
+#include "uuid_v4.h"
+
+// Private LSMTree members the benchmarks time directly
+class LSMTreeBench {
+public:
+    static FieldMap parseFields(LSMTree &tree, const std::string &data) {
+        return tree.parseFields(data);
+    }
+    static std::string serializeFields(LSMTree &tree, const FieldMap &fields) {
+        return tree.serializeFields(fields);
+    }
+    static size_t writeSST(LSMTree &tree, const std::string &path, const SSTEntries &entries) {
+        return tree.writeSST(path, entries);
+    }
+    // The merge a compaction runs, over a single input
+    static size_t scanSST(LSMTree &tree, const std::string &path) {
+        LSMIterator it = tree.compactionIterator({path});
+        size_t entries = 0;
+        for (it.seek(""); it.valid(); it.next()) {
+            entries += it.fields().size();
+        }
+        return entries;
+    }
+};
+
+namespace {
+struct Options {
+    std::vector<size_t> sizes{1000, 10000, 100000};
+    std::string filter;
+    double min_time = 0.5;
+    bool json = false;
+    std::string label;
+    std::string dir;
+};
+
+struct BenchResult {
+    std::string name;
+    // Dataset size, 0 for benchmarks without one
+    size_t size;
+    uint64_t iterations;
+    double ns_per_op;
+    double bytes_per_op;
+    std::string note;
+};
+
+// Keeps the compiler from dropping a computation whose result is unused
+template <typename T>
+void keep(const T &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+std::string jsonEscape(const std::string &text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+class BenchRunner {
+private:
+    const Options &options;
+    std::vector<BenchResult> results;
+
+public:
+    explicit BenchRunner(const Options &options) : options(options) {
+    }
+
+    bool enabled(const std::string &name) const {
+        return name.find(options.filter) != std::string::npos;
+    }
+
+    // Calls op(i) for i = 0, 1, ... in doubling batches until min_time has passed
+    template <typename Op>
+    void run(const std::string &name, size_t size, Op &&op, double bytes_per_op = 0, const std::string &note = {}) {
+        if (!enabled(name))
+            return;
+
+        using Clock = std::chrono::steady_clock;
+        uint64_t iterations = 0;
+        uint64_t batch = 1;
+        Clock::duration elapsed{};
+        while (std::chrono::duration<double>(elapsed).count() < options.min_time) {
+            auto start = Clock::now();
+            for (uint64_t i = 0; i < batch; ++i) {
+                op(iterations + i);
+            }
+            elapsed += Clock::now() - start;
+            iterations += batch;
+            batch = std::min<uint64_t>(batch * 2, 1 << 20);
+        }
+
+        double ns = std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+        results.push_back({name, size, iterations, ns, bytes_per_op, note});
+        std::cerr << name << (size ? " size=" + std::to_string(size) : "") << ": " << ns << " ns/op" << std::endl;
+    }
+
+    void report(std::ostream &out) const {
+        if (!options.json) {
+            char line[256];
+            snprintf(line, sizeof(line), "%-40s %10s %12s %14s %10s  %s\n", "benchmark", "size", "iterations", "ns/op",
+                     "MB/s", "note");
+            out << line;
+            for (const auto &r : results) {
+                double mb_per_s = r.bytes_per_op ? r.bytes_per_op / r.ns_per_op * 1e3 : 0;
+                snprintf(line, sizeof(line), "%-40s %10zu %12llu %14.1f %10.1f  %s\n", r.name.c_str(), r.size,
+                         static_cast<unsigned long long>(r.iterations), r.ns_per_op, mb_per_s, r.note.c_str());
+                out << line;
+            }
+            return;
+        }
+
+        out << "{\n  \"label\": \"" << jsonEscape(options.label) << "\",\n";
+        out << "  \"compiler\": \"" << jsonEscape(__VERSION__) << "\",\n";
+        out << "  \"cpus\": " << std::thread::hardware_concurrency() << ",\n";
+        out << "  \"min_time\": " << options.min_time << ",\n";
+        out << "  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); ++i) {
+            const auto &r = results[i];
+            out << (i ? ",\n" : "\n") << "    {\"name\": \"" << jsonEscape(r.name) << "\", \"size\": " << r.size
+                << ", \"iterations\": " << r.iterations << ", \"ns_per_op\": " << r.ns_per_op
+                << ", \"bytes_per_op\": " << r.bytes_per_op << ", \"note\": \"" << jsonEscape(r.note) << "\"}";
+        }
+        out << "\n  ]\n}\n";
+    }
+};
+
+UUIDv4::UUIDGenerator<std::mt19937_64> uuidGenerator;
+
+std::vector<std::string> makeIds(size_t count) {
+    std::vector<std::string> ids(count);
+    for (auto &id : ids) {
+        id = uuidGenerator.getUUID().str();
+    }
+    return ids;
+}
+
+// {f0@<version>:"vvvv" f1@<version>:"vvvv" ...}, `stride` picks every n-th field
+std::string makeRecord(size_t fields, size_t value_size, uint32_t version, size_t stride = 1) {
+    std::string record = "{";
+    for (size_t f = 0; f < fields; f += stride) {
+        if (record.size() > 1) {
+            record += ' ';
+        }
+        appendFieldToRecord(record, "f" + std::to_string(f), version, '"' + std::string(value_size, 'v') + '"');
+    }
+    return record + "}";
+}
+
+const size_t FIELD_COUNTS[] = {4, 32, 256};
+const size_t RECORD_FIELDS = 4;
+const size_t VALUE_SIZE = 24;
+
+void benchMergeRecords(BenchRunner &runner) {
+    for (size_t fields : FIELD_COUNTS) {
+        // Half of the fields are overwritten by a newer version
+        std::string older = makeRecord(fields, VALUE_SIZE, 1);
+        std::string newer = makeRecord(fields, VALUE_SIZE, 2, 2);
+        runner.run("merge_records/fields=" + std::to_string(fields), 0,
+                   [&](uint64_t) { keep(mergeTwoRecords(newer, older)); }, older.size() + newer.size());
+        // A narrow read of one field
+        FieldProjection projection({internField("f0")});
+        runner.run("merge_records/projected/fields=" + std::to_string(fields), 0,
+                   [&](uint64_t) { keep(mergeTwoRecords(newer, older, projection)); }, older.size() + newer.size());
+    }
+}
+
+void benchFieldCodec(BenchRunner &runner, LSMTree &tree) {
+    for (size_t fields : FIELD_COUNTS) {
+        std::string record = makeRecord(fields, VALUE_SIZE, 3);
+        FieldMap parsed = LSMTreeBench::parseFields(tree, record);
+        runner.run("parse_fields/fields=" + std::to_string(fields), 0,
+                   [&](uint64_t) { keep(LSMTreeBench::parseFields(tree, record)); }, record.size());
+        runner.run("serialize_fields/fields=" + std::to_string(fields), 0,
+                   [&](uint64_t) { keep(LSMTreeBench::serializeFields(tree, parsed)); }, record.size());
+    }
+}
+
+void benchSST(BenchRunner &runner, LSMTree &tree, size_t size) {
+    if (!runner.enabled("write_sst") && !runner.enabled("read_sst"))
+        return;
+
+    std::vector<std::string> ids = makeIds(size);
+    std::sort(ids.begin(), ids.end());
+    std::string record = makeRecord(RECORD_FIELDS, VALUE_SIZE, 1);
+    SSTEntries entries(size);
+    for (size_t i = 0; i < size; ++i) {
+        entries[i].key = ids[i];
+        entries[i].fields = LSMTreeBench::parseFields(tree, record);
+    }
+
+    const std::string path = "bench.sst";
+    size_t file_size = LSMTreeBench::writeSST(tree, path, entries);
+    runner.run("write_sst", size, [&](uint64_t) { keep(LSMTreeBench::writeSST(tree, path, entries)); }, file_size);
+
+    runner.run("read_sst", size, [&](uint64_t) { keep(LSMTreeBench::scanSST(tree, path)); }, file_size);
+    fs::remove(path);
+}
+
+std::string describeShape(const LSMTree &tree) {
+    std::string shape;
+    auto levels = tree.levelStats();
+    for (size_t level = 0; level < levels.size(); ++level) {
+        if (levels[level].files) {
+            shape += (shape.empty() ? "L" : " L") + std::to_string(level) + "=" + std::to_string(levels[level].files);
+        }
+    }
+    return shape;
+}
+
+// Point reads over `size` keys flushed as `files` L0 files. From ten files on,
+// compaction moves them down, so the larger counts measure a leveled tree
+void benchGet(BenchRunner &runner, const std::string &base_dir, size_t size) {
+    const size_t FILE_COUNTS[] = {1, 8, 40};
+    for (size_t files : FILE_COUNTS) {
+        std::string name = "get/files=" + std::to_string(files);
+        if (!runner.enabled(name))
+            continue;
+
+        std::string dir = base_dir + "/" + "get-" + std::to_string(size) + "-" + std::to_string(files);
+        fs::create_directories(dir);
+        if (chdir(dir.c_str()) != 0) {
+            perror(dir.c_str());
+            continue;
+        }
+
+        {
+            auto tree = std::make_unique<LSMTree>();
+            std::vector<std::string> ids = makeIds(size);
+            std::string record = makeRecord(RECORD_FIELDS, VALUE_SIZE, 1);
+            for (size_t f = 0; f < files; ++f) {
+                std::vector<std::pair<std::string, std::string>> batch;
+                for (size_t i = f; i < size; i += files) {
+                    batch.emplace_back(ids[i], record);
+                }
+                tree->flushBatchToL0(batch);
+            }
+            // Let the background compaction settle before measuring
+            while (tree->levelStats()[0].files >= LEVEL_BASE_SIZE) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+
+            std::mt19937_64 rng(42);
+            std::vector<std::string> lookups(std::min<size_t>(size, 1 << 16));
+            for (auto &id : lookups) {
+                id = ids[rng() % ids.size()];
+            }
+            std::vector<std::string> misses = makeIds(lookups.size());
+            std::string shape = describeShape(*tree);
+            runner.run(name, size, [&](uint64_t i) { keep(tree->get(lookups[i % lookups.size()])); }, 0, shape);
+            runner.run(name + "/miss", size, [&](uint64_t i) { keep(tree->get(misses[i % misses.size()])); }, 0, shape);
+        }
+
+        if (chdir(base_dir.c_str()) != 0) {
+            perror(base_dir.c_str());
+        }
+        fs::remove_all(dir);
+    }
+}
+
+void benchWALAppend(BenchRunner &runner) {
+    const size_t ENTRY_SIZES[] = {64, 1024};
+    // Bounds the log so msync keeps working on a mapping of comparable size
+    const size_t MAX_LOG_SIZE = 16 << 20;
+    for (size_t entry_size : ENTRY_SIZES) {
+        std::string name = "wal_append/bytes=" + std::to_string(entry_size);
+        if (!runner.enabled(name))
+            continue;
+
+        MappedFile wal("bench-wal.log");
+        std::string entry(entry_size - 1, 'w');
+        entry += '\n';
+        runner.run(name, 0, [&](uint64_t) {
+            if (wal.size() + entry.size() > MAX_LOG_SIZE) {
+                wal.truncate();
+            }
+            wal.append(entry);
+        }, entry_size);
+        fs::remove("bench-wal.log");
+    }
+}
+
+void benchWALIndex(BenchRunner &runner, size_t size) {
+    // Same layout as the server's recordIdToOffset
+    using WALRecordsMetadata = std::array<std::pair<size_t, size_t>, 4>;
+    std::unordered_map<std::string, WALRecordsMetadata> index;
+    std::vector<std::string> ids = makeIds(size);
+    for (size_t i = 0; i < size; ++i) {
+        index[ids[i]] = {std::make_pair(i * 128, 128), {-1u, 0}, {-1u, 0}, {-1u, 0}};
+    }
+    std::vector<std::string> misses = makeIds(size);
+    runner.run("wal_index/hit", size, [&](uint64_t i) { keep(index.find(ids[i % size])); });
+    runner.run("wal_index/miss", size, [&](uint64_t i) { keep(index.find(misses[i % size])); });
+}
+
+void benchUUID(BenchRunner &runner) {
+    const size_t COUNT = 4096;
+    std::vector<std::string> strings = makeIds(COUNT);
+    std::vector<UUIDv4::UUID> uuids;
+    for (const auto &text : strings) {
+        uuids.push_back(UUIDv4::UUID::fromStrFactory(text));
+    }
+    runner.run("uuid/generate", 0, [&](uint64_t) { keep(uuidGenerator.getUUID()); });
+    runner.run("uuid/parse", 0, [&](uint64_t i) { keep(UUIDv4::UUID::fromStrFactory(strings[i % COUNT])); });
+    runner.run("uuid/format", 0, [&](uint64_t i) { keep(uuids[i % COUNT].str()); });
+}
+
+bool parseOptions(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--json") {
+            options.json = true;
+        } else if (arg == "--sizes" && has_value) {
+            options.sizes.clear();
+            std::stringstream ss(argv[++i]);
+            std::string size;
+            while (std::getline(ss, size, ',')) {
+                options.sizes.push_back(std::stoul(size));
+            }
+        } else if (arg == "--filter" && has_value) {
+            options.filter = argv[++i];
+        } else if (arg == "--min-time" && has_value) {
+            options.min_time = std::stod(argv[++i]);
+        } else if (arg == "--label" && has_value) {
+            options.label = argv[++i];
+        } else if (arg == "--dir" && has_value) {
+            options.dir = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    return !options.sizes.empty() && std::find(options.sizes.begin(), options.sizes.end(), 0) == options.sizes.end();
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+    Options options;
+    try {
+        if (!parseOptions(argc, argv, options)) {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--sizes N,N,...] [--filter <substring>] [--min-time <seconds>] [--json]"
+                         " [--label <text>] [--dir <path>]"
+                      << std::endl;
+            return 2;
+        }
+    } catch (const std::exception &) {
+        std::cerr << "Invalid number in arguments" << std::endl;
+        return 2;
+    }
+
+    bool temporary = options.dir.empty();
+    if (temporary) {
+        char pattern[] = "/tmp/redka-bench-XXXXXX";
+        if (!mkdtemp(pattern)) {
+            perror("mkdtemp");
+            return 1;
+        }
+        options.dir = pattern;
+    }
+    fs::create_directories(options.dir);
+    std::string base_dir = fs::absolute(options.dir).string();
+    if (chdir(base_dir.c_str()) != 0) {
+        perror(base_dir.c_str());
+        return 1;
+    }
+
+    BenchRunner runner(options);
+    benchMergeRecords(runner);
+    benchUUID(runner);
+    benchWALAppend(runner);
+    {
+        // Codec and SST benchmarks need a tree instance, not its data
+        fs::create_directories(base_dir + "/codec");
+        if (chdir((base_dir + "/codec").c_str()) != 0) {
+            perror("codec");
+            return 1;
+        }
+        LSMTree tree;
+        benchFieldCodec(runner, tree);
+        for (size_t size : options.sizes) {
+            benchSST(runner, tree, size);
+        }
+    }
+    if (chdir(base_dir.c_str()) != 0) {
+        perror(base_dir.c_str());
+        return 1;
+    }
+    fs::remove_all(base_dir + "/codec");
+    for (size_t size : options.sizes) {
+        benchWALIndex(runner, size);
+        benchGet(runner, base_dir, size);
+    }
+
+    runner.report(std::cout);
+    if (temporary) {
+        fs::remove_all(base_dir);
+    }
+    return 0;
+}
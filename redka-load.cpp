@@ -0,0 +1,704 @@
+// Load generator for RedkaTalk.
+//
+//   redka-load [--host 127.0.0.1] [--port 8080] [--connections 16] [--threads 4] [--duration 10]
+//              [--records 10000] [--workload a|b|c|f | --mix read,update,create,rmw]
+//              [--keys zipfian|uniform] [--fields 4] [--value-size N | MIN:MAX]
+//              [--pipeline 1] [--rate 0] [--json]
+//
+// First `--records` objects are created, their ids become the key space.
+// Then the workload runs for `--duration` seconds over `--connections`
+// connections spread across `--threads` threads, each connection keeping up
+// to `--pipeline` requests in flight.
+//
+// Closed loop (--rate 0) sends the next request as soon as one completes.
+// Open loop (--rate R) sends R requests per second in total on a fixed
+// schedule and measures every latency from the time the request was due, not
+// from when it was actually sent. A stalled server therefore shows up in the
+// percentiles instead of silently lowering the send rate (coordinated omission).
+//
+// Workloads follow YCSB: A is 50% reads / 50% updates, B 95/5, C read only,
+// F 50% reads / 50% read-modify-write (a read, then an update of the same key).
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+enum class Op {
+    read,
+    update,
+    create,
+    rmw,
+    COUNT,
+};
+const size_t OPS = static_cast<size_t>(Op::COUNT);
+const char *const OP_NAMES[] = {"read", "update", "create", "read-modify-write"};
+
+// Percentages of each operation, in Op order
+using Mix = std::array<int, OPS>;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    size_t connections = 16;
+    size_t threads = 4;
+    double duration = 10;
+    size_t records = 10000;
+    Mix mix{50, 50, 0, 0};
+    bool zipfian = true;
+    size_t fields = 4;
+    size_t min_value_size = 100;
+    size_t max_value_size = 100;
+    size_t pipeline = 1;
+    double rate = 0;
+    bool json = false;
+};
+
+// Log-linear buckets (16 per power of two), the same layout the server uses
+// for its STATS histograms: any percentile is within 1/16 of the true value
+class LatencyHistogram {
+private:
+    static const size_t SUB_BUCKET_BITS = 4;
+    static const size_t SUB_BUCKETS = size_t{1} << SUB_BUCKET_BITS;
+    static const size_t BUCKETS = (65 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(BUCKETS);
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t largest = 0;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < 2 * SUB_BUCKETS)
+            return value;
+        size_t shift = std::bit_width(value) - SUB_BUCKET_BITS - 1;
+        return (shift + 1) * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS;
+    }
+
+    static uint64_t bucketHighest(size_t bucket) {
+        if (bucket < 2 * SUB_BUCKETS)
+            return bucket;
+        size_t shift = bucket / SUB_BUCKETS - 1;
+        uint64_t lowest = static_cast<uint64_t>(bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+        return lowest + ((uint64_t{1} << shift) - 1);
+    }
+
+public:
+    void record(uint64_t nanos) {
+        ++buckets[bucketOf(nanos)];
+        ++total;
+        sum += nanos;
+        largest = std::max(largest, nanos);
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            buckets[b] += other.buckets[b];
+        }
+        total += other.total;
+        sum += other.sum;
+        largest = std::max(largest, other.largest);
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+    uint64_t max() const {
+        return largest;
+    }
+    double mean() const {
+        return total ? static_cast<double>(sum) / total : 0;
+    }
+    uint64_t quantile(double q) const {
+        if (total == 0)
+            return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * total)));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            seen += buckets[b];
+            if (seen >= rank)
+                return std::min(bucketHighest(b), largest);
+        }
+        return largest;
+    }
+};
+
+// YCSB's Zipfian generator (Gray et al., "Quickly generating billion-record
+// synthetic databases") over [0, items), item 0 being the most popular
+class ZipfianGenerator {
+private:
+    uint64_t items;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            sum += 1 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+public:
+    explicit ZipfianGenerator(uint64_t items, double theta = 0.99)
+        : items(items), theta(theta), alpha(1 / (1 - theta)), zetan(zeta(items, theta)) {
+        double zeta2 = zeta(2, theta);
+        eta = (1 - std::pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    // Only reads the generator, so threads can share one with their own RNGs
+    uint64_t next(std::mt19937_64 &rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan;
+        if (uz < 1)
+            return 0;
+        if (uz < 1 + std::pow(0.5, theta))
+            return std::min<uint64_t>(1, items - 1);
+        return std::min<uint64_t>(items - 1, static_cast<uint64_t>(items * std::pow(eta * u - eta + 1, alpha)));
+    }
+};
+
+struct Pending {
+    Op op;
+    // When the request was due; latencies are measured from here
+    Clock::time_point intended;
+    size_t key;
+    // The update half of a read-modify-write
+    bool second_leg = false;
+};
+
+struct Connection {
+    int fd = -1;
+    std::string out;
+    size_t out_offset = 0;
+    std::string in;
+    std::deque<Pending> pending;
+    Clock::time_point next_send;
+    bool dead = false;
+};
+
+struct WorkerStats {
+    std::array<LatencyHistogram, OPS> latencies;
+    uint64_t errors = 0;
+    uint64_t dead_connections = 0;
+};
+
+int connectTo(const Options &options) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr) <= 0) {
+        std::cerr << "Invalid address " << options.host << std::endl;
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+class Worker {
+private:
+    const Options &options;
+    std::vector<Connection> connections;
+    std::mt19937_64 rng;
+    const std::vector<std::string> *ids = nullptr;
+    const ZipfianGenerator *zipfian = nullptr;
+    std::string value_chars;
+
+    // Preload phase
+    size_t creates_left = 0;
+    std::vector<std::string> created;
+
+    bool measuring = false;
+    Clock::time_point measure_end;
+
+    std::string makeRecord() {
+        std::uniform_int_distribution<size_t> size_dist(options.min_value_size, options.max_value_size);
+        std::string record = "{";
+        for (size_t f = 0; f < options.fields; ++f) {
+            size_t size = size_dist(rng);
+            size_t offset = rng() % (value_chars.size() - size + 1);
+            record += (f ? " f" : "f") + std::to_string(f) + ":\"" + value_chars.substr(offset, size) + '"';
+        }
+        return record + "}";
+    }
+
+    size_t chooseKey() {
+        if (zipfian)
+            return zipfian->next(rng);
+        return rng() % ids->size();
+    }
+
+    Op chooseOp() {
+        int roll = static_cast<int>(rng() % 100);
+        for (size_t op = 0; op < OPS; ++op) {
+            if (roll < options.mix[op])
+                return static_cast<Op>(op);
+            roll -= options.mix[op];
+        }
+        return Op::read;
+    }
+
+    void send(Connection &connection, const Pending &request) {
+        bool isUpdate = request.op == Op::update || (request.op == Op::rmw && request.second_leg);
+        if (request.op == Op::create) {
+            connection.out += makeRecord();
+        } else if (isUpdate) {
+            connection.out += "{@" + (*ids)[request.key] + " " + makeRecord() + "}";
+        } else {
+            connection.out += (*ids)[request.key];
+        }
+        connection.out += '\n';
+        connection.pending.push_back(request);
+    }
+
+    void issue(Connection &connection, Clock::time_point intended) {
+        if (!measuring) {
+            --creates_left;
+            send(connection, {Op::create, intended, 0});
+            return;
+        }
+        Op op = chooseOp();
+        send(connection, {op, intended, op == Op::create ? 0 : chooseKey()});
+    }
+
+    void complete(Connection &connection, const std::string &line, Clock::time_point now, WorkerStats &stats) {
+        if (connection.pending.empty()) {
+            ++stats.errors;
+            return;
+        }
+        Pending request = connection.pending.front();
+        connection.pending.pop_front();
+
+        // RDKAbad and RDXbad; the server closes the connection after them
+        if (line == "1" || line == "2") {
+            ++stats.errors;
+            return;
+        }
+        if (!measuring) {
+            created.push_back(line);
+            return;
+        }
+        if (request.op == Op::rmw && !request.second_leg) {
+            request.second_leg = true;
+            send(connection, request);
+            return;
+        }
+        if (now <= measure_end) {
+            stats.latencies[static_cast<size_t>(request.op)].record(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(now - request.intended).count());
+        }
+    }
+
+    bool canIssue(const Connection &connection) const {
+        return !connection.dead && connection.pending.size() < options.pipeline && (measuring || creates_left > 0);
+    }
+
+    void fill(Connection &connection, Clock::time_point now) {
+        if (options.rate > 0 && measuring) {
+            // Requests that could not go out on time keep their due time
+            while (connection.next_send <= now && canIssue(connection)) {
+                issue(connection, connection.next_send);
+                connection.next_send += std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(options.connections / options.rate));
+            }
+        } else {
+            while (canIssue(connection)) {
+                issue(connection, now);
+            }
+        }
+    }
+
+    void drop(Connection &connection, WorkerStats &stats) {
+        if (!connection.dead) {
+            connection.dead = true;
+            ++stats.dead_connections;
+            close(connection.fd);
+        }
+    }
+
+    // One poll round: sends what is buffered, reads and completes responses
+    void pollOnce(WorkerStats &stats, int timeout_ms) {
+        std::vector<pollfd> fds;
+        std::vector<Connection *> polled;
+        for (auto &connection : connections) {
+            if (connection.dead)
+                continue;
+            short events = POLLIN;
+            if (connection.out_offset < connection.out.size()) {
+                events |= POLLOUT;
+            }
+            fds.push_back({connection.fd, events, 0});
+            polled.push_back(&connection);
+        }
+        if (fds.empty() || poll(fds.data(), fds.size(), timeout_ms) <= 0)
+            return;
+
+        Clock::time_point now = Clock::now();
+        char buffer[64 << 10];
+        for (size_t i = 0; i < fds.size(); ++i) {
+            Connection &connection = *polled[i];
+            if (fds[i].revents & POLLOUT) {
+                ssize_t written = ::send(connection.fd, connection.out.data() + connection.out_offset,
+                                         connection.out.size() - connection.out_offset, MSG_NOSIGNAL);
+                if (written < 0 && errno != EAGAIN) {
+                    drop(connection, stats);
+                    continue;
+                }
+                connection.out_offset += std::max<ssize_t>(written, 0);
+                if (connection.out_offset == connection.out.size()) {
+                    connection.out.clear();
+                    connection.out_offset = 0;
+                }
+            }
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t bytes = recv(connection.fd, buffer, sizeof(buffer), 0);
+                if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
+                    drop(connection, stats);
+                    continue;
+                }
+                connection.in.append(buffer, std::max<ssize_t>(bytes, 0));
+                size_t start = 0;
+                size_t end;
+                while ((end = connection.in.find('\n', start)) != std::string::npos) {
+                    complete(connection, connection.in.substr(start, end - start), now, stats);
+                    start = end + 1;
+                }
+                connection.in.erase(0, start);
+            }
+        }
+    }
+
+public:
+    Worker(const Options &options, uint64_t seed) : options(options), rng(seed) {
+        value_chars.resize(options.max_value_size * 2 + 64);
+        for (auto &c : value_chars) {
+            c = static_cast<char>('a' + rng() % 26);
+        }
+    }
+    ~Worker() {
+        for (auto &connection : connections) {
+            if (!connection.dead) {
+                close(connection.fd);
+            }
+        }
+    }
+
+    bool connect(size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            int fd = connectTo(options);
+            if (fd < 0)
+                return false;
+            connections.emplace_back().fd = fd;
+        }
+        return true;
+    }
+
+    // Creates `count` objects, closed loop; returns their ids
+    std::vector<std::string> preload(size_t count, WorkerStats &stats) {
+        measuring = false;
+        creates_left = count;
+        created.clear();
+        auto busy = [&] {
+            return std::any_of(connections.begin(), connections.end(),
+                               [](const Connection &c) { return !c.dead && !c.pending.empty(); });
+        };
+        while (creates_left > 0 || busy()) {
+            Clock::time_point now = Clock::now();
+            for (auto &connection : connections) {
+                fill(connection, now);
+            }
+            if (std::all_of(connections.begin(), connections.end(), [](const Connection &c) { return c.dead; }))
+                break;
+            pollOnce(stats, 100);
+        }
+        return std::move(created);
+    }
+
+    void run(const std::vector<std::string> &key_space, const ZipfianGenerator *key_zipfian, Clock::time_point start,
+             Clock::time_point end, WorkerStats &stats) {
+        ids = &key_space;
+        zipfian = key_zipfian;
+        measuring = true;
+        measure_end = end;
+        for (size_t i = 0; i < connections.size(); ++i) {
+            // Connections start staggered so the open-loop schedule is smooth
+            connections[i].next_send = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+                                                   options.rate > 0 ? (i * options.threads) / options.rate : 0));
+        }
+
+        Clock::time_point now;
+        while ((now = Clock::now()) < end) {
+            Clock::time_point wake = end;
+            for (auto &connection : connections) {
+                fill(connection, now);
+                if (options.rate > 0 && !connection.dead) {
+                    wake = std::min(wake, connection.next_send);
+                }
+            }
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(wake - Clock::now()).count();
+            pollOnce(stats, static_cast<int>(std::clamp<int64_t>(left, 0, 100)));
+        }
+    }
+};
+
+bool parseSizeRange(const std::string &text, size_t &min, size_t &max) {
+    size_t colon = text.find(':');
+    min = std::stoul(text.substr(0, colon));
+    max = colon == std::string::npos ? min : std::stoul(text.substr(colon + 1));
+    return min > 0 && min <= max;
+}
+
+bool parseMix(const std::string &text, Mix &mix) {
+    std::stringstream ss(text);
+    std::string part;
+    size_t i = 0;
+    int total = 0;
+    while (std::getline(ss, part, ',')) {
+        if (i == OPS)
+            return false;
+        mix[i] = std::stoi(part);
+        if (mix[i] < 0)
+            return false;
+        total += mix[i++];
+    }
+    return i == OPS && total == 100;
+}
+
+bool parseWorkload(const std::string &name, Mix &mix) {
+    if (name == "a" || name == "A") {
+        mix = {50, 50, 0, 0};
+    } else if (name == "b" || name == "B") {
+        mix = {95, 5, 0, 0};
+    } else if (name == "c" || name == "C") {
+        mix = {100, 0, 0, 0};
+    } else if (name == "f" || name == "F") {
+        mix = {50, 0, 0, 50};
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parseOptions(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--json") {
+            options.json = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return false;
+        std::string value = argv[++i];
+        if (arg == "--host") {
+            options.host = value;
+        } else if (arg == "--port") {
+            options.port = std::stoi(value);
+        } else if (arg == "--connections") {
+            options.connections = std::stoul(value);
+        } else if (arg == "--threads") {
+            options.threads = std::stoul(value);
+        } else if (arg == "--duration") {
+            options.duration = std::stod(value);
+        } else if (arg == "--records") {
+            options.records = std::stoul(value);
+        } else if (arg == "--workload") {
+            if (!parseWorkload(value, options.mix))
+                return false;
+        } else if (arg == "--mix") {
+            if (!parseMix(value, options.mix))
+                return false;
+        } else if (arg == "--keys") {
+            if (value != "zipfian" && value != "uniform")
+                return false;
+            options.zipfian = value == "zipfian";
+        } else if (arg == "--fields") {
+            options.fields = std::stoul(value);
+        } else if (arg == "--value-size") {
+            if (!parseSizeRange(value, options.min_value_size, options.max_value_size))
+                return false;
+        } else if (arg == "--pipeline") {
+            options.pipeline = std::stoul(value);
+        } else if (arg == "--rate") {
+            options.rate = std::stod(value);
+        } else {
+            return false;
+        }
+    }
+    options.threads = std::min(options.threads, options.connections);
+    return options.connections > 0 && options.threads > 0 && options.pipeline > 0 && options.records > 0 &&
+           options.fields > 0 && options.duration > 0 && options.rate >= 0;
+}
+
+const std::pair<double, const char *> QUANTILES[] = {{0.5, "p50"},   {0.9, "p90"},     {0.99, "p99"},
+                                                     {0.999, "p999"}, {0.9999, "p9999"}};
+
+void report(const Options &options, const WorkerStats &stats, double elapsed) {
+    uint64_t completed = 0;
+    for (const auto &latency : stats.latencies) {
+        completed += latency.count();
+    }
+    double throughput = completed / elapsed;
+
+    if (options.json) {
+        std::cout << "{\n  \"connections\": " << options.connections << ", \"threads\": " << options.threads
+                  << ", \"pipeline\": " << options.pipeline << ", \"rate\": " << options.rate
+                  << ", \"duration\": " << elapsed << ",\n  \"throughput\": " << throughput
+                  << ", \"errors\": " << stats.errors << ", \"dead_connections\": " << stats.dead_connections
+                  << ",\n  \"latency_us\": {";
+        bool first = true;
+        for (size_t op = 0; op < OPS; ++op) {
+            const auto &latency = stats.latencies[op];
+            if (!latency.count())
+                continue;
+            std::cout << (first ? "\n" : ",\n") << "    \"" << OP_NAMES[op] << "\": {\"count\": " << latency.count()
+                      << ", \"mean\": " << latency.mean() / 1e3;
+            for (const auto &[q, name] : QUANTILES) {
+                std::cout << ", \"" << name << "\": " << latency.quantile(q) / 1e3;
+            }
+            std::cout << ", \"max\": " << latency.max() / 1e3 << "}";
+            first = false;
+        }
+        std::cout << "\n  }\n}\n";
+        return;
+    }
+
+    printf("%s loop, %zu connections on %zu threads, pipeline %zu\n", options.rate > 0 ? "open" : "closed",
+           options.connections, options.threads, options.pipeline);
+    printf("throughput: %.0f ops/s over %.1f s, errors: %llu, dropped connections: %llu\n", throughput, elapsed,
+           static_cast<unsigned long long>(stats.errors), static_cast<unsigned long long>(stats.dead_connections));
+    printf("%-18s %10s %10s", "latency, us", "count", "mean");
+    for (const auto &[q, name] : QUANTILES) {
+        printf(" %10s", name);
+    }
+    printf(" %10s\n", "max");
+    for (size_t op = 0; op < OPS; ++op) {
+        const auto &latency = stats.latencies[op];
+        if (!latency.count())
+            continue;
+        printf("%-18s %10llu %10.1f", OP_NAMES[op], static_cast<unsigned long long>(latency.count()),
+               latency.mean() / 1e3);
+        for (const auto &[q, name] : QUANTILES) {
+            printf(" %10.1f", latency.quantile(q) / 1e3);
+        }
+        printf(" %10.1f\n", latency.max() / 1e3);
+    }
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+    Options options;
+    bool valid = false;
+    try {
+        valid = parseOptions(argc, argv, options);
+    } catch (const std::exception &) {
+    }
+    if (!valid) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--host <ip>] [--port <port>] [--connections N] [--threads N] [--duration <seconds>]"
+                     " [--records N] [--workload a|b|c|f | --mix <read>,<update>,<create>,<rmw>]"
+                     " [--keys zipfian|uniform] [--fields N] [--value-size N | MIN:MAX] [--pipeline N]"
+                     " [--rate <ops/s>] [--json]"
+                  << std::endl;
+        return 2;
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<WorkerStats> stats(options.threads);
+    for (size_t t = 0; t < options.threads; ++t) {
+        workers.push_back(std::make_unique<Worker>(options, 0x9e3779b97f4a7c15ULL * (t + 1)));
+        size_t share = options.connections / options.threads + (t < options.connections % options.threads);
+        if (!workers.back()->connect(share))
+            return 1;
+    }
+
+    std::vector<std::vector<std::string>> created(options.threads);
+    {
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < options.threads; ++t) {
+            size_t share = options.records / options.threads + (t < options.records % options.threads);
+            threads.emplace_back([&, t, share] { created[t] = workers[t]->preload(share, stats[t]); });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+    std::vector<std::string> ids;
+    for (auto &part : created) {
+        ids.insert(ids.end(), part.begin(), part.end());
+    }
+    if (ids.empty()) {
+        std::cerr << "No objects were created" << std::endl;
+        return 1;
+    }
+    // Popularity must not follow creation order
+    std::shuffle(ids.begin(), ids.end(), std::mt19937_64(42));
+    std::cerr << "Created " << ids.size() << " objects" << std::endl;
+
+    std::unique_ptr<ZipfianGenerator> zipfian;
+    if (options.zipfian) {
+        zipfian = std::make_unique<ZipfianGenerator>(ids.size());
+    }
+    Clock::time_point start = Clock::now();
+    Clock::time_point end =
+        start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+    {
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < options.threads; ++t) {
+            threads.emplace_back([&, t] { workers[t]->run(ids, zipfian.get(), start, end, stats[t]); });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    WorkerStats total;
+    for (const auto &part : stats) {
+        for (size_t op = 0; op < OPS; ++op) {
+            total.latencies[op].merge(part.latencies[op]);
+        }
+        total.errors += part.errors;
+        total.dead_connections += part.dead_connections;
+    }
+    report(options, total, std::min(elapsed, options.duration));
+    return 0;
+}
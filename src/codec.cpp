@@ -0,0 +1,184 @@
+#include "codec.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <vector>
+
+void putVarint(std::string &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+bool getVarint(std::string_view &in, uint64_t &value) {
+    value = 0;
+    for (size_t i = 0; i < in.size() && i < 10; ++i) {
+        uint8_t byte = static_cast<uint8_t>(in[i]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            in.remove_prefix(i + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace {
+const size_t kMinMatch = 4;
+const size_t kHashBits = 13;
+const size_t kMaxOffset = 65535;
+// The tail is always emitted as literals, so the matcher never reads past the end
+const size_t kLastLiterals = 5;
+
+uint32_t read32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+uint32_t hash4(uint32_t value) {
+    return (value * 2654435761u) >> (32 - kHashBits);
+}
+
+void putLength(std::string &out, size_t length) {
+    while (length >= 255) {
+        out.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    out.push_back(static_cast<char>(length));
+}
+
+bool getLength(std::string_view in, size_t &pos, size_t &length) {
+    while (pos < in.size()) {
+        uint8_t byte = static_cast<uint8_t>(in[pos++]);
+        length += byte;
+        if (byte != 255)
+            return true;
+    }
+    return false;
+}
+
+void emitSequence(std::string &out, const char *literals, size_t literal_length, size_t offset, size_t match_length) {
+    size_t match_code = match_length ? match_length - kMinMatch : 0;
+    out.push_back(static_cast<char>((std::min<size_t>(literal_length, 15) << 4) | std::min<size_t>(match_code, 15)));
+    if (literal_length >= 15) {
+        putLength(out, literal_length - 15);
+    }
+    out.append(literals, literal_length);
+
+    if (match_length) {
+        out.push_back(static_cast<char>(offset & 0xff));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (match_code >= 15) {
+            putLength(out, match_code - 15);
+        }
+    }
+}
+}  // namespace
+
+void lzCompress(std::string_view in, std::string &out) {
+    out.clear();
+    out.reserve(in.size() + in.size() / 255 + 16);
+
+    // Positions are stored +1 so that zero means empty
+    static thread_local std::vector<uint32_t> table;
+    table.assign(size_t{1} << kHashBits, 0);
+
+    const char *base = in.data();
+    size_t size = in.size();
+    size_t anchor = 0;
+    size_t pos = 0;
+    if (size > kMinMatch + kLastLiterals) {
+        size_t limit = size - kLastLiterals;
+        while (pos + kMinMatch <= limit) {
+            uint32_t sequence = read32(base + pos);
+            uint32_t &slot = table[hash4(sequence)];
+            size_t candidate = slot;
+            slot = static_cast<uint32_t>(pos + 1);
+
+            if (candidate && pos - (candidate - 1) <= kMaxOffset && read32(base + candidate - 1) == sequence) {
+                size_t ref = candidate - 1;
+                size_t length = kMinMatch;
+                while (pos + length < limit && base[ref + length] == base[pos + length]) {
+                    ++length;
+                }
+                emitSequence(out, base + anchor, pos - anchor, pos - ref, length);
+                pos += length;
+                anchor = pos;
+            } else {
+                ++pos;
+            }
+        }
+    }
+    emitSequence(out, base + anchor, size - anchor, 0, 0);
+}
+
+bool lzDecompress(std::string_view in, size_t raw_size, std::string &out) {
+    out.clear();
+    out.reserve(raw_size);
+
+    size_t pos = 0;
+    while (pos < in.size()) {
+        uint8_t token = static_cast<uint8_t>(in[pos++]);
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !getLength(in, pos, literal_length))
+            return false;
+        if (in.size() - pos < literal_length || out.size() + literal_length > raw_size)
+            return false;
+        out.append(in.data() + pos, literal_length);
+        pos += literal_length;
+
+        // The last sequence carries literals only
+        if (pos == in.size())
+            break;
+
+        if (in.size() - pos < 2)
+            return false;
+        size_t offset = static_cast<uint8_t>(in[pos]) | (static_cast<size_t>(static_cast<uint8_t>(in[pos + 1])) << 8);
+        pos += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !getLength(in, pos, match_length))
+            return false;
+        match_length += kMinMatch;
+        if (offset == 0 || offset > out.size() || out.size() + match_length > raw_size)
+            return false;
+
+        size_t from = out.size() - offset;
+        if (offset >= match_length) {
+            out.append(out.data() + from, match_length);
+        } else {
+            // Overlapping copy repeats the last `offset` bytes
+            for (size_t i = 0; i < match_length; ++i) {
+                out.push_back(out[from + i]);
+            }
+        }
+    }
+    return out.size() == raw_size;
+}
+
+namespace {
+std::array<uint32_t, 256> makeCrc32cTable() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+const std::array<uint32_t, 256> kCrc32cTable = makeCrc32cTable();
+}  // namespace
+
+uint32_t crc32c(std::string_view data) {
+    uint32_t crc = ~0u;
+    for (char c : data) {
+        crc = kCrc32cTable[(crc ^ static_cast<uint8_t>(c)) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// LEB128 varints used by the SST block encoding
+void putVarint(std::string &out, uint64_t value);
+// Reads a varint from the front of `in` and advances it; false on truncated input
+bool getVarint(std::string_view &in, uint64_t &value);
+
+// LZ77 codec in the spirit of LZ4: a token byte with literal and match
+// lengths, the literals, then a 16-bit back-reference offset. Fast enough to
+// run on every block read, no external dependency.
+void lzCompress(std::string_view in, std::string &out);
+// `raw_size` is the exact decompressed size; false on malformed input
+bool lzDecompress(std::string_view in, size_t raw_size, std::string &out);
+
+// CRC-32C (Castagnoli), software table implementation
+uint32_t crc32c(std::string_view data);
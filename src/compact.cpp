@@ -1,26 +1,48 @@
+#include "codec.h"
 #include "compact.h"
 #include "mapped_file.h"
 #include "merge_records.h"
+#include "metrics.h"
+#include "trace.h"
 
 
-LSMTree::LSMTree() {
+LSMTree::LSMTree(std::string dir) : db_dir(std::move(dir)), version_edit_file(db_dir + "/" + VERSION_EDIT_FILE_NAME) {
     ensureDbDir();
+    // Before the upgrade, which drops .tmp files of unfinished compactions
+    replayVersionEdit();
+    upgradeLegacySSTs();
     loadLevels();
+
+    compaction_thread = std::thread([this] { compactionLoop(); });
+    requestCompaction();
+}
+
+LSMTree::~LSMTree() {
+    {
+        std::lock_guard lock(compaction_mutex);
+        stopping = true;
+    }
+    compaction_cv.notify_one();
+    compaction_thread.join();
 }
 
 void LSMTree::ensureDbDir() {
-    if (!fs::exists(DB_DIR)) {
-        fs::create_directory(DB_DIR);
+    if (!fs::exists(db_dir)) {
+        fs::create_directories(db_dir);
         for (int i = 0; i < 10; ++i) {
-            fs::create_directory(DB_DIR + "/L" + std::to_string(i));
+            fs::create_directory(db_dir + "/L" + std::to_string(i));
         }
     }
 }
 
 void LSMTree::loadLevels() {
-    levels.clear();
+    std::lock_guard load_lock(load_mutex);
+    std::shared_ptr<const LSMVersion> previous = version();
+    auto next = std::make_shared<LSMVersion>();
+
+    auto &levels = next->levels;
     for (int i = 0;; ++i) {
-        std::string level_dir = DB_DIR + "/L" + std::to_string(i);
+        std::string level_dir = db_dir + "/L" + std::to_string(i);
         if (!fs::exists(level_dir))
             break;
 
@@ -34,81 +56,532 @@ void LSMTree::loadLevels() {
         std::reverse(files.begin(), files.end());
         levels.push_back(files);
     }
+
+    // Readers of files that are still live are shared with the previous version
+    for (const auto &level : levels) {
+        for (const auto &sst_path : level) {
+            std::shared_ptr<const SSTReader> reader;
+            if (previous) {
+                auto it = previous->tables.find(sst_path);
+                if (it != previous->tables.end()) {
+                    reader = it->second;
+                }
+            }
+            next->tables[sst_path] = reader ? std::move(reader) : std::make_shared<SSTReader>(sst_path);
+        }
+    }
+
+    std::lock_guard lock(version_mutex);
+    current = std::move(next);
 }
 
-void LSMTree::mergeEntries(SSTEntry &target, const SSTEntry &source) {
-    std::string target_record = serializeFields(target.fields);
-    std::string source_record = serializeFields(source.fields);
-    std::string target_record_with_braces = "{" + target_record + "}";
-    std::string source_record_with_braces = "{" + source_record + "}";
+std::shared_ptr<const LSMVersion> LSMTree::version() const {
+    std::lock_guard lock(version_mutex);
+    return current;
+}
 
-    std::string merged_record = mergeTwoRecords(target_record_with_braces, source_record_with_braces);
-    target.fields = parseFields(merged_record);
+std::vector<LSMTree::LevelStats> LSMTree::levelStats() const {
+    std::shared_ptr<const LSMVersion> snapshot = version();
+    std::vector<LevelStats> stats(snapshot->levels.size());
+    for (size_t level = 0; level < snapshot->levels.size(); ++level) {
+        stats[level].files = snapshot->levels[level].size();
+        for (const auto &sst_path : snapshot->levels[level]) {
+            stats[level].bytes += snapshot->table(sst_path).fileSize();
+        }
+    }
+    return stats;
+}
+
+size_t LSMTree::maxOpenFiles() const {
+    std::shared_ptr<const LSMVersion> snapshot = version();
+    size_t tables = 0;
+    size_t widest = 0;
+    for (const auto &level : snapshot->levels) {
+        tables += level.size();
+        widest = std::max(widest, level.size());
+    }
+    size_t jobs = std::min<size_t>(MAX_SUBCOMPACTIONS, std::max(1u, std::thread::hardware_concurrency()));
+    return tables + jobs * (widest + 1) + 1;
 }
 
-void LSMTree::compactLevel(int level) {
-    if (level >= levels.size())
+SSTReader::SSTReader(const std::string &path, AccessPattern pattern) {
+    if (!file.open(path, false, pattern))
         return;
 
-    if (levels[level].size() >= std::pow(10, level + 1)) {
-        std::map<std::string, SSTEntry> merged_entries;
+    size_t size = file.size();
+    if (size < sizeof(SSTPrelude))
+        return;
 
-        for (const auto &sst_path : levels[level]) {
-            auto entries = readSST(sst_path);
-            for (const auto &entry : entries) {
-                if (merged_entries.find(entry.key) == merged_entries.end()) {
-                    merged_entries[entry.key] = entry;
-                } else {
-                    mergeEntries(merged_entries[entry.key], entry);
-                }
+    SSTPrelude prelude;
+    memcpy(&prelude, file.data(), sizeof(prelude));
+    if (prelude.magic != SST_MAGIC)
+        return;
+
+    SSTFooter footer;
+    if (prelude.format_version == SST_FORMAT_VERSION) {
+        if (size < sizeof(SSTPrelude) + sizeof(SSTFooter))
+            return;
+        memcpy(&footer, file.data() + size - sizeof(footer), sizeof(footer));
+        if (footer.magic != SST_MAGIC)
+            return;
+        size -= sizeof(footer);
+    } else if (prelude.format_version == SST_HEADER_FORMAT_VERSION && size >= sizeof(SSTHeader)) {
+        SSTHeader header;
+        memcpy(&header, file.data(), sizeof(header));
+        footer.entry_count = header.entry_count;
+        footer.block_count = header.block_count;
+        footer.dictionary_offset = header.dictionary_offset;
+        footer.index_offset = header.index_offset;
+    } else {
+        return;
+    }
+    if (footer.dictionary_offset > size || footer.index_offset > size)
+        return;
+
+    std::string_view dictionary(file.data() + footer.dictionary_offset, size - footer.dictionary_offset);
+    uint64_t name_count = 0;
+    if (!getVarint(dictionary, name_count))
+        return;
+    std::vector<FieldId> ids;
+    for (uint64_t i = 0; i < name_count; ++i) {
+        uint64_t length = 0;
+        if (!getVarint(dictionary, length) || length > dictionary.size())
+            return;
+        ids.push_back(internField(dictionary.substr(0, length)));
+        dictionary.remove_prefix(length);
+    }
+
+    std::vector<BlockInfo> index;
+    size_t offset = footer.index_offset;
+    for (uint32_t b = 0; b < footer.block_count; ++b) {
+        BlockInfo info;
+        if (offset + sizeof(SSTBlockHandle) > size)
+            return;
+        memcpy(&info.handle, file.data() + offset, sizeof(SSTBlockHandle));
+        offset += sizeof(SSTBlockHandle);
+        if (offset + info.handle.first_key_length > size)
+            return;
+        info.first_key.assign(file.data() + offset, info.handle.first_key_length);
+        offset += info.handle.first_key_length;
+        index.push_back(std::move(info));
+    }
+
+    entry_count = footer.entry_count;
+    blocks = std::move(index);
+    field_ids = std::move(ids);
+}
+
+uint32_t SSTReader::findBlock(std::string_view key, uint32_t from) const {
+    auto it = std::upper_bound(blocks.begin() + std::min<size_t>(from, blocks.size()), blocks.end(), key,
+                               [](std::string_view k, const BlockInfo &info) { return k < info.first_key; });
+    if (it == blocks.begin())
+        return blockCount();
+    return it - blocks.begin() - 1;
+}
+
+bool SSTReader::loadBlock(uint32_t b, SSTBlock &block) const {
+    block.data.clear();
+    block.entries.clear();
+    if (b >= blocks.size())
+        return false;
+
+    const SSTBlockHandle &handle = blocks[b].handle;
+    if (handle.offset > file.size() || handle.stored_size > file.size() - handle.offset)
+        return false;
+
+    std::string_view stored(file.data() + handle.offset, handle.stored_size);
+    if (crc32c(stored) != handle.checksum)
+        return false;
+
+    if (handle.codec == SST_CODEC_LZ) {
+        if (!lzDecompress(stored, handle.raw_size, block.data))
+            return false;
+    } else if (handle.codec == SST_CODEC_NONE && handle.raw_size == handle.stored_size) {
+        block.data.assign(stored);
+    } else {
+        return false;
+    }
+
+    std::string_view rest(block.data);
+    block.entries.reserve(handle.entry_count);
+    for (uint32_t i = 0; i < handle.entry_count; ++i) {
+        uint64_t key_length = 0;
+        if (!getVarint(rest, key_length) || key_length > rest.size())
+            return false;
+        SSTBlock::EntryPos pos;
+        pos.key_offset = rest.data() - block.data.data();
+        pos.key_length = key_length;
+        rest.remove_prefix(key_length);
+        pos.fields_offset = rest.data() - block.data.data();
+
+        // Skip the fields, they are decoded on access
+        uint64_t field_count = 0;
+        if (!getVarint(rest, field_count))
+            return false;
+        for (uint64_t f = 0; f < field_count; ++f) {
+            uint64_t name_id = 0, version = 0, value_length = 0;
+            if (!getVarint(rest, name_id) || name_id >= field_ids.size() || !getVarint(rest, version) ||
+                !getVarint(rest, value_length) || value_length > rest.size())
+                return false;
+            rest.remove_prefix(value_length);
+        }
+        block.entries.push_back(pos);
+    }
+    return true;
+}
+
+FieldMap SSTReader::decodeFields(const SSTBlock &block, size_t i, std::pmr::memory_resource *resource,
+                                 const FieldProjection &projection) const {
+    FieldMap fields(resource);
+    // Bounds were validated by loadBlock
+    std::string_view rest(block.data);
+    rest.remove_prefix(block.entries[i].fields_offset);
+
+    uint64_t field_count = 0;
+    getVarint(rest, field_count);
+    for (uint64_t f = 0; f < field_count; ++f) {
+        uint64_t name_id = 0, version = 0, value_length = 0;
+        getVarint(rest, name_id);
+        getVarint(rest, version);
+        getVarint(rest, value_length);
+        if (projection.contains(field_ids[name_id])) {
+            fields.try_emplace(field_ids[name_id], static_cast<uint32_t>(version), rest.substr(0, value_length));
+        }
+        rest.remove_prefix(value_length);
+    }
+    return fields;
+}
+
+void SSTReader::releaseBlocks(uint32_t first, uint32_t end) const {
+    if (first >= end || first >= blocks.size())
+        return;
+    size_t begin_offset = blocks[first].handle.offset;
+    size_t end_offset = end < blocks.size() ? blocks[end].handle.offset : file.size();
+    file.dropPages(begin_offset, end_offset - begin_offset);
+}
+
+size_t SSTBlock::lowerBound(std::string_view key) const {
+    size_t lo = 0;
+    size_t hi = entries.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (this->key(mid) < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void LSMTree::mergeEntries(SSTEntry &target, const SSTEntry &source) {
+    // Same rule as mergeTwoRecords: higher version wins, target wins ties
+    for (const auto &[field, fv] : source.fields) {
+        auto [it, inserted] = target.fields.try_emplace(field, fv);
+        if (!inserted && it->second.version < fv.version) {
+            it->second = fv;
+        }
+    }
+}
+
+namespace {
+// Files written by one compaction job share the stem before '-'
+size_t countRuns(const std::vector<std::string> &files) {
+    std::vector<std::string> runs;
+    for (const auto &path : files) {
+        std::string stem = fs::path(path).stem().string();
+        runs.push_back(stem.substr(0, stem.find('-')));
+    }
+    std::sort(runs.begin(), runs.end());
+    return std::unique(runs.begin(), runs.end()) - runs.begin();
+}
+}  // namespace
+
+bool syncFile(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
+
+bool writeFileDurably(const std::string &path, const std::string &data) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return false;
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ::close(fd);
+            return false;
+        }
+        written += n;
+    }
+    bool synced = ::fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
+
+void LSMTree::requestCompaction() {
+    {
+        std::lock_guard lock(compaction_mutex);
+        compaction_requested = true;
+    }
+    compaction_cv.notify_one();
+}
+
+void LSMTree::compactionLoop() {
+    setTraceThreadName("compaction");
+    while (true) {
+        {
+            std::unique_lock lock(compaction_mutex);
+            compaction_cv.wait(lock, [this] { return compaction_requested || stopping; });
+            if (stopping)
+                return;
+            compaction_requested = false;
+        }
+
+        try {
+            while (compactOnce()) {
             }
+        } catch (const std::exception &e) {
+            // Inputs stay in place; retry on the next flush
+            std::cerr << "Compaction failed: " << e.what() << std::endl;
         }
+    }
+}
 
-        std::vector<SSTEntry> entries_to_write;
-        for (auto &[key, entry] : merged_entries) {
-            entries_to_write.push_back(std::move(entry));
+bool LSMTree::compactOnce() {
+    std::shared_ptr<const LSMVersion> snapshot = version();
+    updateRateLimit(*snapshot);
+    for (size_t level = 0; level + 1 < snapshot->levels.size(); ++level) {
+        if (countRuns(snapshot->levels[level]) >= std::pow(10, level + 1)) {
+            compactLevel(*snapshot, level);
+            return true;
         }
-        std::sort(entries_to_write.begin(), entries_to_write.end());
+    }
+    return false;
+}
+
+void LSMTree::updateRateLimit(const LSMVersion &version) {
+    // Debt grows from the L0 compaction trigger to the slowdown trigger
+    double l0_runs = version.levels.empty() ? 0 : countRuns(version.levels[0]);
+    double debt = std::clamp((l0_runs - LEVEL_BASE_SIZE) / (L0_SLOWDOWN_RUNS - LEVEL_BASE_SIZE), 0.0, 1.0);
+    rate_limiter.setRate(MIN_COMPACTION_RATE + (MAX_COMPACTION_RATE - MIN_COMPACTION_RATE) * debt);
+}
+
+std::chrono::microseconds LSMTree::writeDelay() {
+    std::shared_ptr<const LSMVersion> snapshot = version();
+    size_t l0_runs = snapshot->levels.empty() ? 0 : countRuns(snapshot->levels[0]);
+    if (l0_runs >= L0_STOP_RUNS)
+        return WRITE_STOP_RECHECK;
+
+    std::chrono::microseconds delay(0);
+    if (l0_runs >= L0_SLOWDOWN_RUNS) {
+        delay = MAX_WRITE_DELAY * (l0_runs - L0_SLOWDOWN_RUNS + 1) / (L0_STOP_RUNS - L0_SLOWDOWN_RUNS);
+    }
+    return std::max(delay, rate_limiter.debtDelay());
+}
+
+void LSMTree::compactLevel(const LSMVersion &version, int level) {
+    TraceSpan span("compaction", traceEnabled());
+    LatencyTimer timer(Histogram::compaction);
+    countEvent(Counter::compactions);
+    const std::vector<std::string> &inputs = version.levels[level];
+    std::vector<std::string> boundaries = subcompactionBoundaries(version, inputs);
+    size_t jobs = boundaries.size() + 1;
+
+    std::string run = db_dir + "/L" + std::to_string(level + 1) + "/" +
+                      std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+    std::vector<std::string> outputs(jobs);
+    std::vector<char> written(jobs, false);
+    std::vector<std::exception_ptr> errors(jobs);
+    auto runJob = [&](size_t k) {
+        TraceSpan span("subcompaction", traceEnabled());
+        outputs[k] = run + "-" + std::to_string(k) + ".sst";
+        try {
+            written[k] = runSubcompaction(inputs, k == 0 ? "" : boundaries[k - 1], k == jobs - 1 ? "" : boundaries[k],
+                                          outputs[k]);
+        } catch (...) {
+            errors[k] = std::current_exception();
+        }
+    };
+
+    // The calling thread takes the first range, and the ones no thread could
+    // be started for: the started threads are joined either way
+    std::vector<std::thread> workers;
+    workers.reserve(jobs - 1);
+    size_t started = 1;
+    try {
+        for (; started < jobs; ++started) {
+            workers.emplace_back(runJob, started);
+        }
+    } catch (...) {
+    }
+    runJob(0);
+    for (size_t k = started; k < jobs; ++k) {
+        runJob(k);
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    std::vector<std::string> added;
+    for (size_t k = 0; k < jobs; ++k) {
+        if (written[k]) {
+            added.push_back(outputs[k]);
+        }
+    }
+    for (const auto &error : errors) {
+        if (error) {
+            for (const auto &path : added) {
+                fs::remove(path + ".tmp");
+            }
+            std::rethrow_exception(error);
+        }
+    }
+
+    installVersionEdit(added, inputs);
+    loadLevels();
+}
+
+std::vector<std::string> LSMTree::subcompactionBoundaries(const LSMVersion &version,
+                                                          const std::vector<std::string> &inputs) {
+    std::vector<std::string_view> first_keys;
+    uint64_t input_bytes = 0;
+    for (const auto &sst_path : inputs) {
+        const SSTReader &table = version.table(sst_path);
+        for (uint32_t b = 0; b < table.blockCount(); ++b) {
+            first_keys.push_back(table.blockFirstKey(b));
+            input_bytes += table.blockRawSize(b);
+        }
+    }
+
+    size_t jobs = std::min<size_t>({MAX_SUBCOMPACTIONS, std::max(1u, std::thread::hardware_concurrency()),
+                                    input_bytes / MIN_SUBCOMPACTION_BYTES, first_keys.size()});
+    if (jobs <= 1)
+        return {};
+
+    // Blocks are of about the same size, so block start keys are quantiles of the input
+    std::sort(first_keys.begin(), first_keys.end());
+    std::vector<std::string> boundaries;
+    for (size_t k = 1; k < jobs; ++k) {
+        std::string_view key = first_keys[k * first_keys.size() / jobs];
+        if (!key.empty() && (boundaries.empty() || boundaries.back() != key)) {
+            boundaries.emplace_back(key);
+        }
+    }
+    return boundaries;
+}
+
+bool LSMTree::runSubcompaction(const std::vector<std::string> &inputs, const std::string &lower,
+                               const std::string &upper, const std::string &output_path) {
+    // Streams the merge: one block per input and one output block in memory
+    LSMIterator it = compactionIterator(inputs);
+    it.setUpperBound(upper);
+    it.seek(lower);
+    if (!it.valid())
+        return false;
+
+    std::string tmp_path = output_path + ".tmp";
+    fs::remove(tmp_path);
+    SSTBuilder builder(tmp_path, &rate_limiter);
+    for (; it.valid(); it.next()) {
+        builder.add(it.key(), it.fields());
+    }
+    countEvent(Counter::compacted_bytes, builder.finish());
+    return true;
+}
+
+LSMIterator LSMTree::compactionIterator(const std::vector<std::string> &inputs) {
+    std::vector<std::shared_ptr<const SSTReader>> tables;
+    for (const auto &sst_path : inputs) {
+        tables.push_back(std::make_shared<SSTReader>(sst_path, AccessPattern::sequential));
+    }
+    return LSMIterator(this, std::move(tables), true);
+}
+
+void LSMTree::installVersionEdit(const std::vector<std::string> &added, const std::vector<std::string> &removed) {
+    std::string edit;
+    for (const auto &path : added) {
+        if (!syncFile(path + ".tmp"))
+            throw std::runtime_error("Failed to sync " + path + ".tmp");
+        edit += "add " + path + "\n";
+    }
+    for (const auto &path : removed) {
+        edit += "remove " + path + "\n";
+    }
+
+    // The rename is the commit point: after a crash the edit is either
+    // replayed as a whole or never happened and its .tmp files are dropped
+    std::string tmp_edit = version_edit_file + ".tmp";
+    if (!writeFileDurably(tmp_edit, edit))
+        throw std::runtime_error("Failed to write version edit");
+    fs::rename(tmp_edit, version_edit_file);
+    syncFile(db_dir);
+
+    replayVersionEdit();
+}
 
-        std::string new_sst = DB_DIR + "/L" + std::to_string(level + 1) + "/" +
-                            std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) + ".sst";
-        writeSST(new_sst, entries_to_write);
+void LSMTree::replayVersionEdit() {
+    fs::remove(version_edit_file + ".tmp");
+    std::ifstream edit(version_edit_file);
+    if (!edit)
+        return;
 
-        for (const auto &sst_path : levels[level]) {
-            fs::remove(sst_path);
+    // Idempotent, a crash in the middle is finished by the next replay
+    std::string line;
+    while (std::getline(edit, line)) {
+        if (line.rfind("add ", 0) == 0) {
+            std::string path = line.substr(4);
+            if (fs::exists(path + ".tmp")) {
+                fs::rename(path + ".tmp", path);
+            }
+        } else if (line.rfind("remove ", 0) == 0) {
+            fs::remove(line.substr(7));
         }
+    }
+    edit.close();
 
-        loadLevels();
-        compactLevel(level + 1);
+    for (int i = 0;; ++i) {
+        std::string level_dir = db_dir + "/L" + std::to_string(i);
+        if (!fs::exists(level_dir))
+            break;
+        syncFile(level_dir);
     }
+    fs::remove(version_edit_file);
 }
 
-std::vector<SSTEntry> LSMTree::readSST(const std::string &path) {
+SSTEntries LSMTree::readLegacySST(const std::string &path) {
     MappedFile file;
-    if (!file.open(path))
+    if (!file.open(path, false, AccessPattern::sequential))
         return {};
 
     const char *data = static_cast<const char *>(file.data());
     size_t size = file.size();
 
-    if (size < sizeof(SSTHeader))
+    if (size < sizeof(SSTLegacyHeader))
         return {};
 
-    SSTHeader header;
+    SSTLegacyHeader header;
     memcpy(&header, data, sizeof(header));
 
     if (header.entry_count == 0)
         return {};
 
     size_t index_offset = header.index_offset;
-    if (index_offset + header.entry_count * sizeof(SSTIndexEntry) > size) {
+    if (index_offset + header.entry_count * sizeof(SSTLegacyIndexEntry) > size) {
         return {};
     }
 
-    std::vector<SSTIndexEntry> index(header.entry_count);
-    memcpy(index.data(), data + index_offset, header.entry_count * sizeof(SSTIndexEntry));
+    std::vector<SSTLegacyIndexEntry> index(header.entry_count);
+    memcpy(index.data(), data + index_offset, header.entry_count * sizeof(SSTLegacyIndexEntry));
 
-    std::vector<SSTEntry> entries;
+    SSTEntries entries;
     for (const auto &idx : index) {
         if (idx.data_offset + idx.data_length > size) {
             continue;
@@ -134,182 +607,482 @@ std::vector<SSTEntry> LSMTree::readSST(const std::string &path) {
     return entries;
 }
 
-std::map<std::string, FieldValue> LSMTree::parseFields(const std::string &data) {
-    std::map<std::string, FieldValue> fields;
+void LSMTree::upgradeLegacySSTs() {
+    // Rewrites format 1 files (no magic) in the block format, via a temporary
+    // file so that a crash leaves either the old or the new file in place
+    std::vector<fs::path> files;
+    for (int i = 0;; ++i) {
+        std::string level_dir = db_dir + "/L" + std::to_string(i);
+        if (!fs::exists(level_dir))
+            break;
+        for (const auto &entry : fs::directory_iterator(level_dir)) {
+            files.push_back(entry.path());
+        }
+    }
+
+    for (const auto &file_path : files) {
+        std::string path = file_path.string();
+        if (file_path.extension() == ".tmp") {
+            fs::remove(file_path);
+            continue;
+        }
+        if (file_path.extension() != ".sst")
+            continue;
+
+        uint32_t magic = 0;
+        {
+            MappedFile file;
+            if (!file.open(path) || file.size() < sizeof(magic))
+                continue;
+            memcpy(&magic, file.data(), sizeof(magic));
+        }
+        if (magic == SST_MAGIC)
+            continue;
+
+        std::string tmp_path = path + ".tmp";
+        fs::remove(tmp_path);
+        writeSST(tmp_path, readLegacySST(path));
+        fs::rename(tmp_path, path);
+        std::cout << "Upgraded SST " << path << std::endl;
+    }
+}
+
+FieldMap LSMTree::parseFields(const std::string &data, std::pmr::memory_resource *resource) {
+    FieldMap fields(resource);
 
     std::string content = data;
     if (!content.empty() && content.front() == '{' && content.back() == '}') {
         content = content.substr(1, content.size() - 2);
     }
 
-    std::regex field_re(R"((\w+)(@(\d+))?:)"
-                        R"((?:("(?:[^"]|\\")*")|([^ }]+)))");
-
-    std::smatch match;
-    std::string::const_iterator search_start(content.cbegin());
+    // Matches `name[@version]:value` where value is "quoted" or runs up to a
+    // space or '}'. Hand-rolled: std::regex overflows the stack on large values
+    auto isWordChar = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; };
 
-    while (std::regex_search(search_start, content.cend(), match, field_re)) {
-        std::string field = match[1].str();
-        uint32_t version = match[3].matched ? std::stoul(match[3].str()) : 1;
+    size_t pos = 0;
+    while (pos < content.size()) {
+        size_t nameEnd = pos;
+        while (nameEnd < content.size() && isWordChar(content[nameEnd])) {
+            ++nameEnd;
+        }
+        if (nameEnd == pos) {
+            ++pos;
+            continue;
+        }
 
-        std::string value = match[4].matched ? match[4].str() : match[5].str();
+        size_t colon = nameEnd;
+        uint32_t version = 1;
+        if (colon < content.size() && content[colon] == '@') {
+            size_t digitsEnd = colon + 1;
+            while (digitsEnd < content.size() && std::isdigit(static_cast<unsigned char>(content[digitsEnd]))) {
+                ++digitsEnd;
+            }
+            // A version past 32 bits leaves the '@' in place of the ':' and the field is skipped
+            if (parseFieldVersion(std::string_view(content).substr(colon + 1, digitsEnd - colon - 1), version)) {
+                colon = digitsEnd;
+            }
+        }
+        if (colon >= content.size() || content[colon] != ':') {
+            ++pos;
+            continue;
+        }
 
-        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
-            value = value.substr(1, value.size() - 2);
+        size_t valueStart = colon + 1;
+        size_t valueEnd = std::string::npos;
+        if (valueStart < content.size() && content[valueStart] == '"') {
+            size_t closingQuote = content.find('"', valueStart + 1);
+            if (closingQuote != std::string::npos) {
+                valueEnd = closingQuote + 1;
+            }
+        }
+        if (valueEnd == std::string::npos) {
+            valueEnd = content.find_first_of(" }", valueStart);
+            if (valueEnd == std::string::npos) {
+                valueEnd = content.size();
+            }
+        }
+        if (valueEnd == valueStart) {
+            ++pos;
+            continue;
         }
 
-        fields[field] = {version, value};
-        search_start = match[0].second;
+        // Quotes are kept: serializeFields writes values back verbatim
+        std::string value = content.substr(valueStart, valueEnd - valueStart);
 
-        while (search_start != content.cend() && *search_start == ' ') {
-            ++search_start;
+        fields.insert_or_assign(internField(std::string_view(content).substr(pos, nameEnd - pos)),
+                                FieldValue(version, value, resource));
+        pos = valueEnd;
+
+        while (pos < content.size() && content[pos] == ' ') {
+            ++pos;
         }
     }
 
     return fields;
 }
 
-std::string LSMTree::serializeFields(const std::map<std::string, FieldValue> &fields) {
+std::string LSMTree::serializeFields(const FieldMap &fields) {
     std::ostringstream oss;
     bool first = true;
 
-    for (const auto &[field, fv] : fields) {
+    for (auto it : fieldsByName(fields)) {
         if (!first) {
             oss << " ";
         }
         first = false;
 
-        oss << field;
-        if (fv.version > 1) {
-            oss << "@" << fv.version;
+        oss << fieldName(it->first);
+        if (it->second.version > 1) {
+            oss << "@" << it->second.version;
         }
-        oss << ":" << fv.value;
+        oss << ":" << it->second.value;
     }
 
     return oss.str();
 }
 
-void LSMTree::writeSST(const std::string &path, const std::vector<SSTEntry> &entries) {
-    size_t total_size = sizeof(SSTHeader);
-
+size_t LSMTree::writeSST(const std::string &path, const SSTEntries &entries, RateLimiter *limiter) {
+    SSTBuilder builder(path, limiter);
     for (const auto &entry : entries) {
-        total_size += sizeof(uint32_t);
-        total_size += entry.key.size();
-        total_size += serializeFields(entry.fields).size();
+        builder.add(entry.key, entry.fields);
     }
+    return builder.finish();
+}
 
-    total_size += entries.size() * sizeof(SSTIndexEntry);
+SSTBuilder::SSTBuilder(const std::string &path, RateLimiter *limiter) : limiter(limiter) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw std::runtime_error("Failed to create SST file " + path);
+    buffer.reserve(SST_WRITE_BUFFER_SIZE);
 
-    MappedFile file;
-    if (!file.open(path, true)) {
-        throw std::runtime_error("Failed to create SST file");
+    SSTPrelude prelude;
+    prelude.magic = SST_MAGIC;
+    prelude.format_version = SST_FORMAT_VERSION;
+    append(std::string_view(reinterpret_cast<const char *>(&prelude), sizeof(prelude)));
+}
+
+SSTBuilder::~SSTBuilder() {
+    if (fd != -1) {
+        ::close(fd);
+    }
+}
+
+void SSTBuilder::append(std::string_view data) {
+    buffer.append(data);
+    offset += data.size();
+    if (buffer.size() >= SST_WRITE_BUFFER_SIZE) {
+        flushBuffer();
+    }
+}
+
+void SSTBuilder::flushBuffer() {
+    if (limiter && !buffer.empty()) {
+        limiter->request(buffer.size());
     }
+    size_t written = 0;
+    while (written < buffer.size()) {
+        ssize_t n = ::write(fd, buffer.data() + written, buffer.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw std::runtime_error("Failed to write SST file");
+        written += n;
+    }
+    buffer.clear();
+}
 
-    if (file.size() < total_size) {
-        if (!file.resize(total_size)) {
-            throw std::runtime_error("Failed to resize SST file");
+void SSTBuilder::add(std::string_view key, const FieldMap &fields) {
+    if (block_entries == 0) {
+        first_key = key;
+    }
+    putVarint(raw, key.size());
+    raw.append(key);
+    putVarint(raw, fields.size());
+    for (const auto &[field, fv] : fields) {
+        auto [it, inserted] = dictionary_ids.try_emplace(field, dictionary.size());
+        if (inserted) {
+            dictionary.push_back(field);
         }
+        putVarint(raw, it->second);
+        putVarint(raw, fv.version);
+        putVarint(raw, fv.value.size());
+        raw.append(fv.value);
+    }
+    ++block_entries;
+    ++entry_count;
+    if (raw.size() >= SST_BLOCK_SIZE) {
+        flushBlock();
     }
+}
 
-    char *data = static_cast<char *>(file.data());
+void SSTBuilder::flushBlock() {
+    if (block_entries == 0)
+        return;
 
-    SSTHeader header;
-    header.entry_count = entries.size();
-    header.index_offset = sizeof(SSTHeader);
-    for (const auto &entry : entries) {
-        header.index_offset += sizeof(uint32_t) + entry.key.size() + serializeFields(entry.fields).size();
+    SSTBlockHandle handle;
+    handle.offset = offset;
+    handle.raw_size = raw.size();
+    handle.entry_count = block_entries;
+    handle.codec = SST_CODEC_NONE;
+    std::string_view stored = raw;
+    if (SST_COMPRESS_BLOCKS) {
+        lzCompress(raw, compressed);
+        if (compressed.size() <= raw.size() - raw.size() / 8) {
+            handle.codec = SST_CODEC_LZ;
+            stored = compressed;
+        }
     }
-    memcpy(data, &header, sizeof(header));
+    handle.stored_size = stored.size();
+    handle.checksum = crc32c(stored);
+    handle.first_key_length = first_key.size();
+    append(stored);
+
+    index.append(reinterpret_cast<const char *>(&handle), sizeof(handle));
+    index.append(first_key);
+    ++block_count;
+    raw.clear();
+    block_entries = 0;
+}
 
-    size_t data_offset = sizeof(SSTHeader);
-    std::vector<SSTIndexEntry> index;
+size_t SSTBuilder::finish() {
+    flushBlock();
+
+    SSTFooter footer;
+    footer.entry_count = entry_count;
+    footer.block_count = block_count;
+    footer.dictionary_offset = offset;
+    std::string dictionary_data;
+    putVarint(dictionary_data, dictionary.size());
+    for (FieldId field : dictionary) {
+        const std::string &name = fieldName(field);
+        putVarint(dictionary_data, name.size());
+        dictionary_data.append(name);
+    }
+    append(dictionary_data);
+    footer.index_offset = offset;
+    append(index);
+    footer.magic = SST_MAGIC;
+    append(std::string_view(reinterpret_cast<const char *>(&footer), sizeof(footer)));
+    flushBuffer();
+
+    int closed = ::close(fd);
+    fd = -1;
+    if (closed != 0)
+        throw std::runtime_error("Failed to close SST file");
+    return offset;
+}
 
-    for (const auto &entry : entries) {
-        std::string fields_data = serializeFields(entry.fields);
-        uint32_t total_len = entry.key.size() + fields_data.size();
+void LSMTree::put(const std::string &key, const std::string &value) {
+    SSTEntries entries(1);
+    entries[0].key = key;
+    entries[0].fields = parseFields(value);
 
-        memcpy(data + data_offset, &total_len, sizeof(total_len));
-        data_offset += sizeof(total_len);
+    std::string sst_path =
+        db_dir + "/L0/" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) + ".sst";
+    rate_limiter.charge(writeSST(sst_path + ".tmp", entries));
+    fs::rename(sst_path + ".tmp", sst_path);
 
-        memcpy(data + data_offset, entry.key.data(), entry.key.size());
-        data_offset += entry.key.size();
+    loadLevels();
+    requestCompaction();
+}
 
-        memcpy(data + data_offset, fields_data.data(), fields_data.size());
-        data_offset += fields_data.size();
+void LSMTree::flushBatchToL0(const std::vector<std::pair<std::string, std::string>> &batch) {
+    TraceSpan span("flush");
+    LatencyTimer timer(Histogram::flush);
+    countEvent(Counter::flushes);
+    std::string sst_path =
+        db_dir + "/L0/" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) + ".sst";
+    {
+        std::pmr::monotonic_buffer_resource arena(JOB_ARENA_INITIAL_SIZE);
+        std::pmr::map<std::pmr::string, SSTEntry> latest_entries(&arena);
+
+        for (const auto &[key, value] : batch) {
+            SSTEntry new_entry(&arena);
+            new_entry.key = key;
+            new_entry.fields = parseFields(value, &arena);
+
+            auto it = latest_entries.find(new_entry.key);
+            if (it == latest_entries.end()) {
+                latest_entries.try_emplace(new_entry.key, std::move(new_entry));
+            } else {
+                mergeEntries(new_entry, it->second);
+                it->second = std::move(new_entry);
+            }
+        }
 
-        SSTIndexEntry idx;
-        idx.key_length = entry.key.size();
-        idx.data_offset = data_offset - total_len - sizeof(total_len);
-        idx.data_length = total_len;
-        index.push_back(idx);
+        SSTEntries entries(&arena);
+        entries.reserve(latest_entries.size());
+        for (auto &[key, entry] : latest_entries) {
+            entries.push_back(std::move(entry));
+        }
+        // Flushes run on the request thread: charged now, paid off by delaying writes.
+        // Published by the rename, so the compaction thread never lists a partial file
+        size_t written = writeSST(sst_path + ".tmp", entries);
+        countEvent(Counter::flushed_bytes, written);
+        rate_limiter.charge(written);
+        fs::rename(sst_path + ".tmp", sst_path);
     }
+    loadLevels();
+    requestCompaction();
+}
 
-    memcpy(data + header.index_offset, index.data(), index.size() * sizeof(SSTIndexEntry));
+std::string LSMTree::get(const std::string &key, const FieldProjection &projection) {
+    return multiGet({key}, projection).front();
 }
 
-void LSMTree::put(const std::string &key, const std::string &value) {
-    SSTEntry entry;
-    entry.key = key;
-    entry.fields = parseFields(value);
+std::vector<std::string> LSMTree::multiGet(const std::vector<std::string> &sorted_keys,
+                                           const FieldProjection &projection) {
+    TraceSpan span("sst_get");
+    std::vector<FieldMap> merged_fields(sorted_keys.size());
 
-    std::vector<SSTEntry> entries;
-    entries.push_back(entry);
+    std::shared_ptr<const LSMVersion> snapshot = version();
+    SSTBlock block;
+    for (const auto &level : snapshot->levels) {
+        for (const auto &sst_path : level) {
+            const SSTReader &table = snapshot->table(sst_path);
+            // Keys are sorted, so blocks are visited in order and each is loaded at most once
+            uint32_t loaded = table.blockCount();
+            uint32_t b = 0;
+            for (size_t i = 0; i < sorted_keys.size(); ++i) {
+                b = table.findBlock(sorted_keys[i], b == table.blockCount() ? 0 : b);
+                if (b == table.blockCount())
+                    continue;
+                if (b != loaded) {
+                    loaded = b;
+                    if (!table.loadBlock(b, block)) {
+                        std::cerr << "Skipping corrupt block " << b << " in " << sst_path << std::endl;
+                        continue;
+                    }
+                }
 
-    std::string sst_path =
-        DB_DIR + "/L0/" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) + ".sst";
-    writeSST(sst_path, entries);
+                size_t pos = block.lowerBound(sorted_keys[i]);
+                if (pos == block.size() || block.key(pos) != sorted_keys[i])
+                    continue;
 
-    loadLevels();
-    compactLevel(0);
+                for (const auto &[field, fv] :
+                     table.decodeFields(block, pos, std::pmr::get_default_resource(), projection)) {
+                    if (fv.version > merged_fields[i][field].version) {
+                        merged_fields[i][field] = fv;
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<std::string> results;
+    results.reserve(sorted_keys.size());
+    for (const auto &fields : merged_fields) {
+        results.push_back(fields.empty() ? "" : serializeFields(fields));
+    }
+    return results;
 }
 
-void LSMTree::flushBatchToL0(const std::vector<std::pair<std::string, std::string>> &batch) {
-    std::map<std::string, SSTEntry> latest_entries;
+LSMIterator LSMTree::newIterator() {
+    return LSMIterator(this);
+}
 
-    for (const auto &[key, value] : batch) {
-        SSTEntry new_entry;
-        new_entry.key = key;
-        new_entry.fields = parseFields(value);
+LSMIterator::LSMIterator(LSMTree *tree) : tree(tree) {
+    std::shared_ptr<const LSMVersion> version = tree->version();
+    for (const auto &level : version->levels) {
+        for (const auto &sst_path : level) {
+            tables.push_back(version->tables.at(sst_path));
+        }
+    }
+}
+
+LSMIterator::LSMIterator(LSMTree *tree, std::vector<std::shared_ptr<const SSTReader>> tables, bool compaction_input)
+    : tree(tree), tables(std::move(tables)), compaction_input(compaction_input) {
+}
 
-        auto it = latest_entries.find(key);
-        if (it == latest_entries.end()) {
-            latest_entries[key] = new_entry;
+void LSMIterator::seek(const std::string &key) {
+    cursors.clear();
+    for (size_t rank = 0; rank < tables.size(); ++rank) {
+        const SSTReader *table = tables[rank].get();
+        uint32_t b = table->findBlock(key);
+        b = b == table->blockCount() ? 0 : b;
+        Cursor cursor{table, b, {}, 0, rank, b};
+        if (!table->loadBlock(cursor.block_index, cursor.block)) {
+            if (compaction_input && table->blockCount() > 0)
+                throw std::runtime_error("Corrupt SST block " + std::to_string(b));
+            // Corrupt (or empty) first block: start from the next one
+            cursor.pos = cursor.block.size();
         } else {
-            mergeEntries(new_entry, it->second);
-            it->second = new_entry;
+            cursor.pos = cursor.block.lowerBound(key);
+        }
+        if (settleCursor(cursor)) {
+            cursors.push_back(std::move(cursor));
         }
     }
+    std::make_heap(cursors.begin(), cursors.end(), cursorAfter);
+    mergeCurrent();
+}
 
-    std::vector<SSTEntry> entries;
-    for (auto &[key, entry] : latest_entries) {
-        entries.push_back(std::move(entry));
+void LSMIterator::next() {
+    if (is_valid) {
+        mergeCurrent();
     }
-    std::string sst_path =
-        DB_DIR + "/L0/" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) + ".sst";
-    writeSST(sst_path, entries);
-    loadLevels();
-    compactLevel(0);
 }
 
-std::string LSMTree::get(const std::string &key) {
-    loadLevels();
-    std::map<std::string, FieldValue> merged_fields;
+void LSMIterator::setUpperBound(std::string bound) {
+    upper_bound = std::move(bound);
+}
 
-    for (const auto &level : levels) {
-        for (const auto &sst_path : level) {
-            auto entries = readSST(sst_path);
-            auto it = std::lower_bound(entries.begin(), entries.end(), key,
-                                       [](const SSTEntry &e, const std::string &k) { return e.key < k; });
-
-            if (it != entries.end() && it->key == key) {
-                for (const auto &[field, fv] : it->fields) {
-                    if (fv.version > merged_fields[field].version) {
-                        merged_fields[field] = fv;
-                    }
-                }
+bool LSMIterator::cursorAfter(const Cursor &lhs, const Cursor &rhs) {
+    std::string_view lhs_key = lhs.key();
+    std::string_view rhs_key = rhs.key();
+    return lhs_key != rhs_key ? lhs_key > rhs_key : lhs.rank > rhs.rank;
+}
+
+bool LSMIterator::settleCursor(Cursor &cursor) const {
+    while (cursor.pos >= cursor.block.size()) {
+        // Merged into the output already, the input is not read there again
+        if (compaction_input && cursor.block_index + 1 - cursor.released >= SCAN_RELEASE_BLOCKS) {
+            cursor.table->releaseBlocks(cursor.released, cursor.block_index + 1);
+            cursor.released = cursor.block_index + 1;
+        }
+        if (++cursor.block_index >= cursor.table->blockCount())
+            return false;
+        cursor.pos = 0;
+        if (!cursor.table->loadBlock(cursor.block_index, cursor.block)) {
+            if (compaction_input)
+                throw std::runtime_error("Corrupt SST block " + std::to_string(cursor.block_index));
+            std::cerr << "Skipping corrupt SST block " << cursor.block_index << std::endl;
+        }
+    }
+    return true;
+}
+
+void LSMIterator::mergeCurrent() {
+    is_valid = false;
+    current_fields.clear();
+    if (cursors.empty())
+        return;
+
+    std::string_view min_key = cursors.front().key();
+    if (!upper_bound.empty() && min_key >= upper_bound)
+        return;
+
+    current_key = std::string(min_key);
+    // Cursors on the same key pop newest first; each is advanced past it
+    while (!cursors.empty() && cursors.front().key() == current_key) {
+        std::pop_heap(cursors.begin(), cursors.end(), cursorAfter);
+        Cursor &cursor = cursors.back();
+        for (const auto &[field, fv] : cursor.table->decodeFields(cursor.block, cursor.pos)) {
+            if (fv.version > current_fields[field].version) {
+                current_fields[field] = fv;
             }
         }
+
+        ++cursor.pos;
+        if (settleCursor(cursor)) {
+            std::push_heap(cursors.begin(), cursors.end(), cursorAfter);
+        } else {
+            cursors.pop_back();
+        }
     }
+    is_valid = true;
+}
 
-    return merged_fields.empty() ? "" : serializeFields(merged_fields);
-}
\ No newline at end of file
+std::string LSMIterator::value() const {
+    return tree->serializeFields(current_fields);
+}
@@ -7,67 +7,468 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <cctype>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
 #include <cmath>
 #include <cstring>
+#include <exception>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <map>
-#include <regex>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include "field_symbols.h"
+#include "mapped_file.h"
+#include "rate_limiter.h"
+
 namespace fs = std::filesystem;
 
 const size_t LEVEL_BASE_SIZE = 10;
 const std::string DB_DIR = "lsm_db";
+// Entries are packed into data blocks of about this many raw bytes
+const size_t SST_BLOCK_SIZE = 8 << 10;
+// Compaction reads its inputs front to back and drops the pages behind it
+// every this many blocks (about 1 MiB)
+const uint32_t SCAN_RELEASE_BLOCKS = 128;
+// Blocks are LZ-compressed when that saves at least an eighth of their size
+const bool SST_COMPRESS_BLOCKS = true;
+const uint32_t SST_MAGIC = 0x53444b52;  // "RKDS"
+const uint32_t SST_FORMAT_VERSION = 3;
+// Format with the offsets in a header; still read, compactions rewrite it
+const uint32_t SST_HEADER_FORMAT_VERSION = 2;
+// SST files are written through a buffer of this size
+const size_t SST_WRITE_BUFFER_SIZE = 1 << 20;
+// First chunk of the arena a flush allocates from
+const size_t JOB_ARENA_INITIAL_SIZE = 1 << 20;
+// A compaction is split into key ranges merged on separate threads, at most
+// one per core and each with at least this much (uncompressed) input
+const size_t MAX_SUBCOMPACTIONS = 32;
+const size_t MIN_SUBCOMPACTION_BYTES = 4 << 20;
+// Pending version edit: files a compaction adds and removes, applied as a
+// whole. Lives in the tree's directory
+const std::string VERSION_EDIT_FILE_NAME = "EDIT";
+// Writes are delayed once L0 holds this many runs, increasingly up to
+// MAX_WRITE_DELAY, and held entirely from L0_STOP_RUNS until compaction catches up
+const size_t L0_SLOWDOWN_RUNS = 20;
+const size_t L0_STOP_RUNS = 36;
+const std::chrono::microseconds MAX_WRITE_DELAY = std::chrono::milliseconds(50);
+const std::chrono::microseconds WRITE_STOP_RECHECK = std::chrono::milliseconds(10);
+// Flush and compaction write bandwidth, raised from the minimum towards the
+// maximum as compaction debt grows
+const double MIN_COMPACTION_RATE = 16 << 20;
+const double MAX_COMPACTION_RATE = 256 << 20;
+// Background writes are throttled in pieces of this size
+const size_t RATE_LIMIT_CHUNK = 1 << 20;
 
 #pragma pack(push, 1)
-struct SSTHeader {
+// Format 1: header, entries with text fields, flat index. Only read to upgrade
+// old files at startup
+struct SSTLegacyHeader {
     uint32_t entry_count;
     uint64_t index_offset;
 };
 
-struct SSTIndexEntry {
+struct SSTLegacyIndexEntry {
     uint32_t key_length;
     uint64_t data_offset;
     uint32_t data_length;
 };
+
+// Format 2: header, data blocks, field-name dictionary, block index
+struct SSTHeader {
+    uint32_t magic;
+    uint32_t format_version;
+    uint32_t entry_count;
+    uint32_t block_count;
+    uint64_t dictionary_offset;
+    uint64_t index_offset;
+};
+
+// Format 3: prelude, data blocks, field-name dictionary, block index, footer.
+// Written in one pass, so everything known only at the end is in the footer
+struct SSTPrelude {
+    uint32_t magic;
+    uint32_t format_version;
+};
+
+struct SSTFooter {
+    uint32_t entry_count;
+    uint32_t block_count;
+    uint64_t dictionary_offset;
+    uint64_t index_offset;
+    uint32_t magic;
+};
+
+// Block index entry, followed by the first key of the block
+struct SSTBlockHandle {
+    uint64_t offset;
+    uint32_t stored_size;
+    uint32_t raw_size;
+    uint32_t entry_count;
+    // CRC-32C of the stored (possibly compressed) bytes
+    uint32_t checksum;
+    uint8_t codec;
+    uint32_t first_key_length;
+};
 #pragma pack(pop)
 
+enum SSTBlockCodec : uint8_t {
+    SST_CODEC_NONE = 0,
+    SST_CODEC_LZ = 1,
+};
+
+// Entries are allocator-aware: flush and compaction jobs build them in a
+// per-job monotonic arena and drop the arena in one go, everything else uses
+// the default resource
 struct FieldValue {
-    uint32_t version;
-    std::string value;
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    uint32_t version = 0;
+    std::pmr::string value;
+
+    FieldValue() = default;
+    FieldValue(const FieldValue &) = default;
+    FieldValue(FieldValue &&) = default;
+    FieldValue &operator=(const FieldValue &) = default;
+    FieldValue &operator=(FieldValue &&) = default;
+
+    explicit FieldValue(const allocator_type &alloc) : value(alloc) {
+    }
+    FieldValue(uint32_t version, std::string_view value, const allocator_type &alloc = {})
+        : version(version), value(value, alloc) {
+    }
+    FieldValue(const FieldValue &other, const allocator_type &alloc)
+        : version(other.version), value(other.value, alloc) {
+    }
+    FieldValue(FieldValue &&other, const allocator_type &alloc)
+        : version(other.version), value(std::move(other.value), alloc) {
+    }
 };
 
+// Fields by interned name
+using FieldMap = std::pmr::map<FieldId, FieldValue>;
+
 struct SSTEntry {
-    std::string key;
-    std::map<std::string, FieldValue> fields;
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    std::pmr::string key;
+    FieldMap fields;
+
+    SSTEntry() = default;
+    SSTEntry(const SSTEntry &) = default;
+    SSTEntry(SSTEntry &&) = default;
+    SSTEntry &operator=(const SSTEntry &) = default;
+    SSTEntry &operator=(SSTEntry &&) = default;
+
+    explicit SSTEntry(const allocator_type &alloc) : key(alloc), fields(alloc) {
+    }
+    SSTEntry(const SSTEntry &other, const allocator_type &alloc) : key(other.key, alloc), fields(other.fields, alloc) {
+    }
+    SSTEntry(SSTEntry &&other, const allocator_type &alloc)
+        : key(std::move(other.key), alloc), fields(std::move(other.fields), alloc) {
+    }
 
     bool operator<(const SSTEntry &other) const {
         return key < other.key;
     }
 };
 
-class LSMTree {
+using SSTEntries = std::pmr::vector<SSTEntry>;
+
+// Decompressed data block. Entries are varint-encoded as
+//   key_length key field_count (name_id version value_length value)*
+// where name_id indexes the per-file field-name dictionary.
+class SSTBlock {
+private:
+    friend class SSTReader;
+
+    struct EntryPos {
+        uint32_t key_offset;
+        uint32_t key_length;
+        uint32_t fields_offset;
+    };
+
+    std::string data;
+    std::vector<EntryPos> entries;
+
+public:
+    size_t size() const {
+        return entries.size();
+    }
+    std::string_view key(size_t i) const {
+        return {data.data() + entries[i].key_offset, entries[i].key_length};
+    }
+    size_t lowerBound(std::string_view key) const;
+};
+
+// Read-only view of one SST file: keeps it mapped with the block index and
+// dictionary decoded, data blocks are read and decompressed on demand. The
+// readers of a version serve point lookups and map files for random access;
+// scans over a whole file open a sequential reader of their own
+class SSTReader {
+private:
+    struct BlockInfo {
+        SSTBlockHandle handle;
+        std::string first_key;
+    };
+
+    MappedFile file;
+    uint32_t entry_count = 0;
+    std::vector<BlockInfo> blocks;
+    // Dictionary ids mapped to process-wide field ids
+    std::vector<FieldId> field_ids;
+
+public:
+    explicit SSTReader(const std::string &path, AccessPattern pattern = AccessPattern::random);
+
+    uint32_t size() const {
+        return entry_count;
+    }
+    size_t fileSize() const {
+        return file.size();
+    }
+    uint32_t blockCount() const {
+        return blocks.size();
+    }
+    std::string_view blockFirstKey(uint32_t b) const {
+        return blocks[b].first_key;
+    }
+    uint32_t blockRawSize(uint32_t b) const {
+        return blocks[b].handle.raw_size;
+    }
+    // Last block (at or after `from`) whose first key is not greater than
+    // `key`; blockCount() if the key sorts before the whole file
+    uint32_t findBlock(std::string_view key, uint32_t from = 0) const;
+    // Verifies the checksum and decompresses; false on a corrupt block
+    bool loadBlock(uint32_t b, SSTBlock &block) const;
+    // Drops the pages of blocks [first, end) from memory once a scan is done with them
+    void releaseBlocks(uint32_t first, uint32_t end) const;
+    // Fields outside `projection` are skipped without copying their values
+    FieldMap decodeFields(const SSTBlock &block, size_t i,
+                          std::pmr::memory_resource *resource = std::pmr::get_default_resource(),
+                          const FieldProjection &projection = {}) const;
+};
+
+class RateLimiter;
+
+// Writes an SST file in one pass: entries, added in key order, are packed into
+// blocks that go to the file through a buffer as soon as they fill up, and
+// finish() appends the dictionary, block index and footer. Memory is one block
+// plus the index whatever the size of the file.
+class SSTBuilder {
 private:
+    int fd = -1;
+    // With a limiter every buffer flush waits for its tokens
+    RateLimiter *limiter;
+    std::string buffer;
+    uint64_t offset = 0;
+
+    // Per-file dictionary: ids are assigned in order of first use
+    std::unordered_map<FieldId, uint32_t> dictionary_ids;
+    std::vector<FieldId> dictionary;
+    std::string index;
+    std::string raw;
+    std::string compressed;
+    std::string first_key;
+    uint32_t block_entries = 0;
+    uint32_t block_count = 0;
+    uint32_t entry_count = 0;
+
+    void append(std::string_view data);
+    void flushBlock();
+    void flushBuffer();
+
+public:
+    // Throws std::runtime_error if the file cannot be created
+    explicit SSTBuilder(const std::string &path, RateLimiter *limiter = nullptr);
+    // An unfinished file is left in place for the caller to remove
+    ~SSTBuilder();
+    SSTBuilder(const SSTBuilder &) = delete;
+    SSTBuilder &operator=(const SSTBuilder &) = delete;
+
+    void add(std::string_view key, const FieldMap &fields);
+    // Writes the tail and closes the file; returns its size. Throws on I/O errors
+    size_t finish();
+};
+
+class LSMTree;
+
+// Immutable set of live SST files. Readers take the current version and keep
+// it for as long as they need, so a compaction finishing meanwhile does not
+// unmap files under them.
+struct LSMVersion {
+    // Per level, newest first
     std::vector<std::vector<std::string>> levels;
+    std::unordered_map<std::string, std::shared_ptr<const SSTReader>> tables;
+
+    const SSTReader &table(const std::string &path) const {
+        return *tables.at(path);
+    }
+};
+
+// Ordered view over every SST level: a heap-based merge of per-file block cursors
+// where versions of the same key are merged with the same rule as get().
+// Reads the version that was current when it was created. Compaction runs the
+// same merge over its inputs only.
+class LSMIterator {
+private:
+    friend class LSMTree;
+
+    struct Cursor {
+        const SSTReader *table;
+        uint32_t block_index;
+        SSTBlock block;
+        size_t pos;
+        // Lower rank is newer data
+        size_t rank;
+        // First block whose pages are still held, see compaction_input
+        uint32_t released;
+
+        std::string_view key() const {
+            return block.key(pos);
+        }
+    };
+
+    LSMTree *tree;
+    // Newest first, kept open for as long as the iterator lives
+    std::vector<std::shared_ptr<const SSTReader>> tables;
+    // Reading compaction inputs: pages behind the cursors are dropped, and a
+    // corrupt block fails the scan instead of being skipped
+    bool compaction_input = false;
+    // Binary heap, see cursorAfter
+    std::vector<Cursor> cursors;
+    std::string upper_bound;
+    std::string current_key;
+    FieldMap current_fields;
+    bool is_valid = false;
+
+    explicit LSMIterator(LSMTree *tree);
+    LSMIterator(LSMTree *tree, std::vector<std::shared_ptr<const SSTReader>> tables, bool compaction_input);
+    // Heap order: the smallest key, then the newest table, on top
+    static bool cursorAfter(const Cursor &lhs, const Cursor &rhs);
+    // Moves past exhausted blocks; false once the table is exhausted
+    bool settleCursor(Cursor &cursor) const;
+    // Merges every version of the smallest key and moves past it
+    void mergeCurrent();
+
+public:
+    // Positions on the first key not less than `key`
+    void seek(const std::string &key);
+    void next();
+    bool valid() const {
+        return is_valid;
+    }
+    // Exclusive; empty means unbounded
+    void setUpperBound(std::string bound);
+    const std::string &key() const {
+        return current_key;
+    }
+    // Merged fields of the current key, serialized like get()
+    std::string value() const;
+    const FieldMap &fields() const {
+        return current_fields;
+    }
+};
+
+class LSMTree {
+private:
+    friend class LSMIterator;
+    // redka-bench drives the codecs and SST I/O directly
+    friend class LSMTreeBench;
+
+    // Holds the level directories L0..L9 and the version edit
+    const std::string db_dir;
+    const std::string version_edit_file;
+
+    std::shared_ptr<const LSMVersion> current;
+    // Guards `current`; held only to copy or swap the pointer
+    mutable std::mutex version_mutex;
+    // Serializes rebuilding the version between flushes and compactions
+    std::mutex load_mutex;
+
+    RateLimiter rate_limiter{MIN_COMPACTION_RATE};
+
+    // Compactions run on a background thread woken up by flushes
+    std::thread compaction_thread;
+    std::mutex compaction_mutex;
+    std::condition_variable compaction_cv;
+    bool compaction_requested = false;
+    bool stopping = false;
 
     void ensureDbDir();
+    void replayVersionEdit();
+    void upgradeLegacySSTs();
+    // Rescans the level directories and installs a new current version
     void loadLevels();
+    std::shared_ptr<const LSMVersion> version() const;
     void mergeEntries(SSTEntry &target, const SSTEntry &source);
-    void compactLevel(int level);
-    std::vector<SSTEntry> readSST(const std::string &path);
-    std::map<std::string, FieldValue> parseFields(const std::string &data);
-    std::string serializeFields(const std::map<std::string, FieldValue> &fields);
-    void writeSST(const std::string &path, const std::vector<SSTEntry> &entries);
+    void compactionLoop();
+    void requestCompaction();
+    // Compacts the first level over its trigger; false if there is none
+    bool compactOnce();
+    void compactLevel(const LSMVersion &version, int level);
+    // Adapts the rate limit to the compaction debt
+    void updateRateLimit(const LSMVersion &version);
+    // Splits the inputs' key space into ranges of about equal size
+    std::vector<std::string> subcompactionBoundaries(const LSMVersion &version,
+                                                     const std::vector<std::string> &inputs);
+    // Merges the inputs' keys in [lower, upper) into `output_path`.tmp; false if the range is empty
+    bool runSubcompaction(const std::vector<std::string> &inputs, const std::string &lower, const std::string &upper,
+                          const std::string &output_path);
+    // Merging iterator over `inputs` (newest first) through sequential
+    // readers of its own, so compaction does not evict the pages lookups use
+    LSMIterator compactionIterator(const std::vector<std::string> &inputs);
+    // Durably records the edit, then renames the added .tmp files in and removes the inputs
+    void installVersionEdit(const std::vector<std::string> &added, const std::vector<std::string> &removed);
+    SSTEntries readLegacySST(const std::string &path);
+    FieldMap parseFields(const std::string &data,
+                         std::pmr::memory_resource *resource = std::pmr::get_default_resource());
+    std::string serializeFields(const FieldMap &fields);
+    // Returns the file size; with a limiter the writes are throttled chunk by chunk
+    size_t writeSST(const std::string &path, const SSTEntries &entries, RateLimiter *limiter = nullptr);
 
 public:
-    LSMTree();
+    explicit LSMTree(std::string dir = DB_DIR);
+    ~LSMTree();
     void put(const std::string &key, const std::string &value);
     void flushBatchToL0(const std::vector<std::pair<std::string, std::string>> &batch);
-    std::string get(const std::string &key);
+    std::string get(const std::string &key, const FieldProjection &projection = {});
+    // Looks up a sorted batch of keys sweeping each SST index once; results
+    // are in the order of `sorted_keys`, serialized like get()
+    std::vector<std::string> multiGet(const std::vector<std::string> &sorted_keys,
+                                      const FieldProjection &projection = {});
+    LSMIterator newIterator();
+    // How long to hold the next write: grows as L0 fills up and while flushes
+    // are over their write budget. At the stop trigger writes should keep
+    // waiting and asking again.
+    std::chrono::microseconds writeDelay();
+
+    struct LevelStats {
+        size_t files = 0;
+        uint64_t bytes = 0;
+    };
+    // Shape of the current version, one entry per level
+    std::vector<LevelStats> levelStats() const;
+    // Descriptors the tree may hold at once: a reader per SST of the current
+    // version, and on top of them a compaction of its widest level (private
+    // readers of every input per subcompaction, an output each) and a flush
+    size_t maxOpenFiles() const;
 };
 
+// Fsyncs a file or a directory
+bool syncFile(const std::string &path);
+// Writes the whole file and fsyncs it
+bool writeFileDurably(const std::string &path, const std::string &data);
+
 #endif
\ No newline at end of file
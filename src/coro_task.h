@@ -1,5 +1,6 @@
 #pragma once
 
+#include "frame_pool.h"
 #include "task.h"
 
 #include <cassert>
@@ -25,6 +26,14 @@ namespace redka::io {
             }
             std::suspend_always initial_suspend() noexcept { return {}; }
 
+            static void* operator new(size_t size) {
+                return detail::FramePool::Allocate(size);
+            }
+
+            static void operator delete(void* ptr, size_t size) noexcept {
+                detail::FramePool::Deallocate(ptr, size);
+            }
+
             auto&& await_transform(auto&& coro) {
                 return std::forward<decltype(coro)>(coro);
             }
@@ -82,12 +91,20 @@ namespace redka::io {
             return false;
         }
 
-        auto await_suspend(std::coroutine_handle<> cont) noexcept {
-            auto& promise = handle_.promise();
-
-            promise.cont_ = cont;
+        // The callee runs right here. One that finishes without suspending
+        // returns into this frame and the caller goes on, so a loop of such
+        // awaits does not pile frames on the stack the way a symmetric
+        // transfer back from final_suspend would wherever it is not compiled
+        // into a tail call. Only a callee that really suspended resumes its
+        // caller from final_suspend, from the executor's stack
+        bool await_suspend(std::coroutine_handle<> cont) noexcept {
+            handle_.resume();
+            if (handle_.done()) {
+                return false;
+            }
 
-            return handle_;
+            handle_.promise().cont_ = cont;
+            return true;
         }
 
         T await_resume() {
@@ -138,6 +155,14 @@ namespace redka::io {
             }
             std::suspend_always initial_suspend() noexcept { return {}; }
 
+            static void* operator new(size_t size) {
+                return detail::FramePool::Allocate(size);
+            }
+
+            static void operator delete(void* ptr, size_t size) noexcept {
+                detail::FramePool::Deallocate(ptr, size);
+            }
+
             auto&& await_transform(auto&& coro) noexcept {
                 return std::forward<decltype(coro)>(coro);
             }
@@ -211,12 +236,14 @@ namespace redka::io {
             return false;
         }
 
-        auto await_suspend(std::coroutine_handle<> cont) noexcept {
-            auto& promise = handle_.promise();
-
-            promise.cont_ = cont;
+        bool await_suspend(std::coroutine_handle<> cont) noexcept {
+            handle_.resume();
+            if (handle_.done()) {
+                return false;
+            }
 
-            return handle_;
+            handle_.promise().cont_ = cont;
+            return true;
         }
 
         void await_resume() {
@@ -233,6 +260,15 @@ namespace redka::io {
 
         CoroResult(CoroResult<void>&& other) = delete;
 
+        // Detached tasks live on the heap until their final_suspend
+        static void* operator new(size_t size) {
+            return detail::FramePool::Allocate(size);
+        }
+
+        static void operator delete(void* ptr, size_t size) noexcept {
+            detail::FramePool::Deallocate(ptr, size);
+        }
+
         CoroResult<void>* fire_and_forgive() && {
             return std::make_unique<CoroResult<void>>(std::move(*this), OnHeapTag{}).release();
         }
@@ -1,5 +1,6 @@
 #include "executor.h"
 #include "net.h"
+#include "trace.h"
 
 #include <cassert>
 
@@ -21,17 +22,68 @@ namespace redka::io {
         return cur_executor;
     }
 
+    void Executor::ScheduleAfter(Clock::duration delay, Timer& timer, ITask* task) {
+        // A zero delay yields: the task runs after the queue drains, not a tick later
+        timers_.Add(timer, delay > Clock::duration::zero() ? Clock::now() + delay : Clock::time_point::min(), task);
+    }
+
+    void Executor::CancelTimer(Timer& timer) {
+        if (!timers_.Cancel(timer) && timer.Task() && timer.Task()->IsLinked()) {
+            runq_.Remove(timer.Task());
+        }
+    }
+
+    void Executor::FireTimers() {
+        timers_.Advance(Clock::now(), runq_);
+    }
+
+    int Executor::PollTimeout() const {
+        auto next = timers_.NextExpiry();
+        if (!next) {
+            return -1;
+        }
+
+        // Rounded up, so the poller never wakes before the deadline and spins
+        auto left = *next - Clock::now();
+        if (left <= Clock::duration::zero()) {
+            return 0;
+        }
+        return static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(left).count());
+    }
+
     void Executor::Run() {
         while (true) {
             ITask* task;
-            while ((task = runq_.Pop())) {
-                cur_executor = this;
-                task->Run();
-                cur_executor = nullptr;
+            {
+                // Time spent here is what a woken-up task waits in the queue
+                bool tracing = traceEnabled();
+                TraceSpan span("run_queue", tracing);
+                uint64_t sampled = sampledRequests();
+                auto start = tracing ? Clock::now() : Clock::time_point{};
+                while ((task = runq_.Pop())) {
+                    cur_executor = this;
+                    task->Run();
+                    cur_executor = nullptr;
+                }
+                if (tracing && sampledRequests() == sampled && Clock::now() - start < SLOW_RUN_QUEUE) {
+                    span.discard();
+                }
             }
 
-            acceptor_->PollAll(this);
-            assert(!runq_.Empty());
+            FireTimers();
+            if (!runq_.Empty()) {
+                continue;
+            }
+
+            acceptor_->PollAll(this, PollTimeout());
+            FireTimers();
         }
     }
+
+    CoroResult<void> SleepFor(Executor::Clock::duration delay) {
+        CoroResult<void>* this_coro = co_await ThisCoro;
+        Timer timer;
+        Executor::GetCur()->ScheduleAfter(delay, timer, this_coro);
+        co_await std::suspend_always{};
+    }
 }
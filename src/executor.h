@@ -1,23 +1,93 @@
 #pragma once
 
+#include "coro_task.h"
 #include "task.h"
 #include "intrusive_queue.h"
+#include "timer_wheel.h"
+
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <optional>
 
 namespace redka::io {
     class Acceptor;
 
     class Executor {
     public:
+        using Clock = std::chrono::steady_clock;
+
+        // With tracing on, batches of the run queue that take longer are traced
+        // even if no sampled request ran in them
+        static constexpr auto SLOW_RUN_QUEUE = std::chrono::milliseconds(1);
+
         explicit Executor(Acceptor* acceptor);
 
         void Schedule(ITask* task);
 
+        // Schedules the task once `delay` has passed; the poller wakes up for it.
+        // `timer` must stay alive until then or until it is cancelled
+        void ScheduleAfter(Clock::duration delay, Timer& timer, ITask* task);
+
+        // The task will not run for this timer, even if it is already due
+        void CancelTimer(Timer& timer);
+
         void Run();
 
+        // Tasks ready to run and timers still waiting, for the metrics
+        size_t RunQueueSize() const {
+            return runq_.Size();
+        }
+        size_t TimerCount() const {
+            return timers_.Size();
+        }
+
         static Executor* GetCur();
 
     private:
+        // Moves due timers to the run queue
+        void FireTimers();
+
+        // Milliseconds until the nearest timer, -1 if there is none
+        int PollTimeout() const;
+
         Acceptor* acceptor_;
         detail::IntrusiveQueue<ITask> runq_;
+        TimerWheel timers_;
     };
+
+    // Suspends the calling coroutine for at least `delay` without blocking the executor
+    CoroResult<void> SleepFor(Executor::Clock::duration delay);
+
+    // Runs `op`, empty if it has not finished within `timeout`. Then `cancel`
+    // is called and must make `op` finish soon, e.g. by shutting its socket
+    // down; the operation is waited for rather than abandoned, so whatever it
+    // refers to stays valid once this returns
+    template <typename T, std::invocable Cancel>
+    CoroResult<std::optional<T>> WithTimeout(CoroResult<T>&& op, Executor::Clock::duration timeout, Cancel cancel) {
+        struct TimeoutTask final : ITask {
+            Cancel& cancel;
+            bool fired = false;
+
+            explicit TimeoutTask(Cancel& cancel)
+                : cancel(cancel) {
+            }
+
+            void Run() override {
+                fired = true;
+                cancel();
+            }
+        };
+
+        TimeoutTask onTimeout(cancel);
+        Timer timer;
+        Executor* executor = Executor::GetCur();
+        executor->ScheduleAfter(timeout, timer, &onTimeout);
+        T result = co_await std::move(op);
+        executor->CancelTimer(timer);
+        if (onTimeout.fired) {
+            co_return std::nullopt;
+        }
+        co_return std::optional<T>(std::move(result));
+    }
 }
@@ -0,0 +1,105 @@
+#include "field_symbols.h"
+
+#include <algorithm>
+
+namespace {
+// FNV-1a, field names are short
+size_t hashName(std::string_view name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : name) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+    }
+    return hash;
+}
+}  // namespace
+
+FieldSymbols::FieldSymbols() : slots(new std::atomic<const std::string *>[CAPACITY]) {
+    for (size_t i = 0; i < CAPACITY; ++i) {
+        slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+FieldSymbols::~FieldSymbols() {
+    for (size_t i = 0; i < CAPACITY; ++i) {
+        delete slots[i].load(std::memory_order_relaxed);
+    }
+}
+
+FieldSymbols &FieldSymbols::global() {
+    static FieldSymbols symbols;
+    return symbols;
+}
+
+FieldSymbols::Probe FieldSymbols::probe(std::string_view name, bool insert, FieldId &id) const {
+    std::unique_ptr<std::string> candidate;
+    size_t slot = hashName(name) & (CAPACITY - 1);
+    for (size_t probes = 0; probes < MAX_PROBES; ++probes, slot = (slot + 1) & (CAPACITY - 1)) {
+        const std::string *existing = slots[slot].load(std::memory_order_acquire);
+        if (!existing) {
+            // Slots are never freed: a name past an empty slot was never added
+            if (!insert)
+                return Probe::missing;
+            if (!candidate) {
+                candidate = std::make_unique<std::string>(name);
+            }
+            // A racing thread may claim the slot first, possibly with the same name
+            if (slots[slot].compare_exchange_strong(existing, candidate.get(), std::memory_order_acq_rel)) {
+                candidate.release();
+                id = slot;
+                return Probe::inserted;
+            }
+        }
+        if (*existing == name) {
+            id = slot;
+            return Probe::found;
+        }
+    }
+    return Probe::full;
+}
+
+bool FieldSymbols::findOverflow(std::string_view name, FieldId &id) const {
+    auto it = std::find(overflow.begin(), overflow.end(), name);
+    if (it == overflow.end())
+        return false;
+    id = CAPACITY + (it - overflow.begin());
+    return true;
+}
+
+FieldId FieldSymbols::intern(std::string_view name) {
+    FieldId id = 0;
+    Probe result = probe(name, true, id);
+    if (result == Probe::inserted) {
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (result != Probe::full)
+        return id;
+
+    std::lock_guard lock(overflowMutex);
+    if (findOverflow(name, id))
+        return id;
+    overflow.emplace_back(name);
+    count.fetch_add(1, std::memory_order_relaxed);
+    return CAPACITY + overflow.size() - 1;
+}
+
+bool FieldSymbols::tryIntern(std::string_view name, FieldId &id) {
+    Probe result = probe(name, size() < MAX_NAMES, id);
+    if (result == Probe::inserted) {
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (result != Probe::full)
+        return result != Probe::missing;
+
+    // Only names interned by storage are past a full window
+    std::lock_guard lock(overflowMutex);
+    return findOverflow(name, id);
+}
+
+bool FieldSymbols::find(std::string_view name, FieldId &id) const {
+    Probe result = probe(name, false, id);
+    if (result != Probe::full)
+        return result == Probe::found;
+
+    std::lock_guard lock(overflowMutex);
+    return findOverflow(name, id);
+}
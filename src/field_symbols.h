@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using FieldId = uint32_t;
+
+// Process-wide table of interned field names. Schemas have a few dozen
+// distinct names across all records, so merges and SST handling work with
+// 32-bit ids and only turn them back into names when a record is printed.
+//
+// Open addressing over atomic slots; an id is the slot index and names are
+// never removed, so both intern() and name() are lock-free and an id stays
+// valid for the life of the process. Ids are not persisted: SST files keep
+// their own name dictionary.
+//
+// Clients only add names through tryIntern(), which refuses new ones past
+// MAX_NAMES, so the table stays half empty and a name is found within a few
+// probes. Storage only interns names that got in that way or were read from
+// SST files at startup; should those not fit, intern() gives them ids past
+// the slots from a locked overflow list instead of failing.
+class FieldSymbols {
+private:
+    static const size_t CAPACITY = 1 << 16;
+    static const size_t MAX_NAMES = CAPACITY / 2;
+    // A name lives within this many slots of its hash or in the overflow list
+    static const size_t MAX_PROBES = 64;
+
+    std::unique_ptr<std::atomic<const std::string *>[]> slots;
+    std::atomic<size_t> count{0};
+    mutable std::mutex overflowMutex;
+    std::deque<std::string> overflow;
+
+    FieldSymbols();
+
+    enum class Probe {
+        found,
+        inserted,
+        // Not in the table, and `insert` was false
+        missing,
+        // Not in the window, and no slot left in it
+        full,
+    };
+    // Looks `name` up in its probe window, claiming a free slot for it if
+    // `insert`; the caller counts an inserted name
+    Probe probe(std::string_view name, bool insert, FieldId &id) const;
+    // Under overflowMutex
+    bool findOverflow(std::string_view name, FieldId &id) const;
+
+public:
+    ~FieldSymbols();
+    FieldSymbols(const FieldSymbols &) = delete;
+    FieldSymbols &operator=(const FieldSymbols &) = delete;
+
+    static FieldSymbols &global();
+
+    FieldId intern(std::string_view name);
+    // False, with nothing added, for a new name once the table holds
+    // MAX_NAMES of them
+    bool tryIntern(std::string_view name, FieldId &id);
+    // False if the name was never interned
+    bool find(std::string_view name, FieldId &id) const;
+    const std::string &name(FieldId id) const {
+        if (id >= CAPACITY) {
+            std::lock_guard lock(overflowMutex);
+            return overflow[id - CAPACITY];
+        }
+        return *slots[id].load(std::memory_order_acquire);
+    }
+    size_t size() const {
+        return count.load(std::memory_order_relaxed);
+    }
+};
+
+inline FieldId internField(std::string_view name) {
+    return FieldSymbols::global().intern(name);
+}
+
+inline bool tryInternField(std::string_view name, FieldId &id) {
+    return FieldSymbols::global().tryIntern(name, id);
+}
+
+inline bool findField(std::string_view name, FieldId &id) {
+    return FieldSymbols::global().find(name, id);
+}
+
+inline const std::string &fieldName(FieldId id) {
+    return FieldSymbols::global().name(id);
+}
+
+// Fields a read is restricted to. Default-constructed it selects every field;
+// built from a list it selects only those, possibly none
+class FieldProjection {
+private:
+    std::vector<FieldId> ids;
+    bool all = true;
+
+public:
+    FieldProjection() = default;
+    explicit FieldProjection(std::vector<FieldId> fields) : ids(std::move(fields)), all(false) {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+
+    bool selectsAll() const {
+        return all;
+    }
+    // Projections list a handful of fields, a binary search beats hashing
+    bool contains(FieldId id) const {
+        return all || std::binary_search(ids.begin(), ids.end(), id);
+    }
+};
+
+// Ids of a field map ordered by field name, the order records are printed in
+template <typename Map>
+std::vector<typename Map::const_iterator> fieldsByName(const Map &fields) {
+    std::vector<typename Map::const_iterator> ordered;
+    ordered.reserve(fields.size());
+    for (auto it = fields.begin(); it != fields.end(); ++it) {
+        ordered.push_back(it);
+    }
+    std::sort(ordered.begin(), ordered.end(),
+              [](const auto &lhs, const auto &rhs) { return fieldName(lhs->first) < fieldName(rhs->first); });
+    return ordered;
+}
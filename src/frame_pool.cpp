@@ -0,0 +1,93 @@
+#include "frame_pool.h"
+
+#include <new>
+
+#if defined(__SANITIZE_ADDRESS__)
+#define REDKA_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define REDKA_ASAN 1
+#endif
+#endif
+
+#ifdef REDKA_ASAN
+#include <sanitizer/asan_interface.h>
+#define POISON_BLOCK(ptr, size) ASAN_POISON_MEMORY_REGION(ptr, size)
+#define UNPOISON_BLOCK(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+#define POISON_BLOCK(ptr, size) ((void)(ptr), (void)(size))
+#define UNPOISON_BLOCK(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+namespace redka::io::detail {
+    FramePool& FramePool::Local() noexcept {
+        static thread_local FramePool pool;
+        return pool;
+    }
+
+    void* FramePool::Allocate(size_t size) {
+        auto& pool = Local();
+        if (size == 0 || size > kNumClasses * kGranularity) {
+            ++pool.stats_.oversized;
+            return ::operator new(size);
+        }
+
+        size_t cls = ClassOf(size);
+        auto& size_class = pool.classes_[cls];
+        if (size_class.head) {
+            FreeBlock* block = size_class.head;
+            UNPOISON_BLOCK(block, (cls + 1) * kGranularity);
+            size_class.head = block->next;
+            --size_class.count;
+            --pool.stats_.cached;
+            ++pool.stats_.reused;
+            return block;
+        }
+
+        ++pool.stats_.allocated;
+        return ::operator new((cls + 1) * kGranularity);
+    }
+
+    void FramePool::Deallocate(void* ptr, size_t size) noexcept {
+        if (!ptr) {
+            return;
+        }
+
+        auto& pool = Local();
+        if (size == 0 || size > kNumClasses * kGranularity) {
+            ::operator delete(ptr);
+            return;
+        }
+
+        size_t cls = ClassOf(size);
+        auto& size_class = pool.classes_[cls];
+        if (size_class.count >= kMaxCachedPerClass) {
+            ::operator delete(ptr);
+            return;
+        }
+
+        auto* block = static_cast<FreeBlock*>(ptr);
+        block->next = size_class.head;
+        size_class.head = block;
+        ++size_class.count;
+        ++pool.stats_.cached;
+        // Catch use-after-free of pooled frames under ASan
+        POISON_BLOCK(block, (cls + 1) * kGranularity);
+    }
+
+    FramePoolStats FramePool::Stats() noexcept {
+        return Local().stats_;
+    }
+
+    FramePool::~FramePool() {
+        for (size_t cls = 0; cls < kNumClasses; ++cls) {
+            FreeBlock* block = classes_[cls].head;
+            while (block) {
+                UNPOISON_BLOCK(block, (cls + 1) * kGranularity);
+                FreeBlock* next = block->next;
+                ::operator delete(block);
+                block = next;
+            }
+        }
+    }
+}
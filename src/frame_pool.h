@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+namespace redka::io::detail {
+    struct FramePoolStats {
+        // Blocks obtained from the global operator new
+        size_t allocated{};
+        // Allocations served from a freelist
+        size_t reused{};
+        // Allocations too large for any size class, not pooled
+        size_t oversized{};
+        // Blocks currently parked in the freelists
+        size_t cached{};
+    };
+
+    // Per-thread size-class freelists for coroutine frames and other short-lived
+    // io objects. Every request spawns several frames (ReadSome, WriteAll, ...)
+    // of a handful of distinct sizes, so after warm-up all of them are served
+    // from the freelists and the request path does not touch malloc.
+    class FramePool {
+    public:
+        static constexpr size_t kGranularity = 64;
+        static constexpr size_t kNumClasses = 64;  // up to 4 KiB
+        static constexpr size_t kMaxCachedPerClass = 4096;
+
+        static void* Allocate(size_t size);
+
+        static void Deallocate(void* ptr, size_t size) noexcept;
+
+        static FramePoolStats Stats() noexcept;
+
+        FramePool() = default;
+        FramePool(const FramePool&) = delete;
+        FramePool& operator=(const FramePool&) = delete;
+
+        ~FramePool();
+
+    private:
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        struct SizeClass {
+            FreeBlock* head{};
+            size_t count{};
+        };
+
+        static FramePool& Local() noexcept;
+
+        static size_t ClassOf(size_t size) noexcept {
+            return (size + kGranularity - 1) / kGranularity - 1;
+        }
+
+        std::array<SizeClass, kNumClasses> classes_{};
+        FramePoolStats stats_{};
+    };
+}
@@ -2,6 +2,7 @@
 
 #include <cassert>
 #include <concepts>
+#include <cstddef>
 
 namespace redka::io::detail {
     template <typename T>
@@ -64,6 +65,7 @@ namespace redka::io::detail {
 
         void Push(Node* elem) {
             elem->LinkBefore(&head_);
+            ++size_;
         }
 
         T* Pop() noexcept {
@@ -73,14 +75,28 @@ namespace redka::io::detail {
 
             Node* front = head_.next_;
             front->Unlink();
+            --size_;
             return front->Get();
         }
 
+        // `elem` must be in this queue
+        void Remove(Node* elem) noexcept {
+            assert(elem->IsLinked());
+
+            elem->Unlink();
+            --size_;
+        }
+
         bool Empty() const noexcept {
             return head_.next_ == &head_;
         }
+
+        size_t Size() const noexcept {
+            return size_;
+        }
     private:
         Intrusive<T> head_{};
+        size_t size_ = 0;
 
     };
 }
@@ -0,0 +1,190 @@
+#include "io_buffer.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <new>
+
+namespace redka::io {
+BufferPool& BufferPool::Local() noexcept {
+    static thread_local BufferPool pool;
+    return pool;
+}
+
+size_t BufferPool::ClassOf(size_t size) noexcept {
+    size_t shift = std::bit_width(std::max<size_t>(size, 1) - 1);
+    return shift <= kMinBlockShift ? 0 : shift - kMinBlockShift;
+}
+
+char* BufferPool::Acquire(size_t& size) {
+    size_t cls = ClassOf(size);
+    size = size_t{1} << (cls + kMinBlockShift);
+    if (cls < kNumClasses && free_[cls]) {
+        FreeBlock* block = free_[cls];
+        free_[cls] = block->next;
+        cached_bytes_ -= size;
+        return reinterpret_cast<char*>(block);
+    }
+
+    return static_cast<char*>(::operator new(size));
+}
+
+void BufferPool::Release(char* block, size_t size) noexcept {
+    if (!block) {
+        return;
+    }
+
+    size_t cls = ClassOf(size);
+    if (cls >= kNumClasses || cached_bytes_ + size > kMaxCachedBytes) {
+        ::operator delete(block);
+        return;
+    }
+
+    auto* free_block = reinterpret_cast<FreeBlock*>(block);
+    free_block->next = free_[cls];
+    free_[cls] = free_block;
+    cached_bytes_ += size;
+}
+
+BufferPool::~BufferPool() {
+    for (FreeBlock* block : free_) {
+        while (block) {
+            FreeBlock* next = block->next;
+            ::operator delete(block);
+            block = next;
+        }
+    }
+}
+
+bool RingBuffer::Reserve(size_t size) {
+    if (size <= capacity_) {
+        return true;
+    }
+    if (size > max_capacity_) {
+        return false;
+    }
+
+    size_t new_capacity = std::max(size, capacity_ * 2);
+    char* new_data = BufferPool::Local().Acquire(new_capacity);
+
+    // Linearize the old contents at the start of the new block
+    size_t old_size = Size();
+    size_t copied = 0;
+    while (copied < old_size) {
+        auto chunk = ReadableSpan();
+        std::memcpy(new_data + copied, chunk.data(), chunk.size());
+        copied += chunk.size();
+        head_ += chunk.size();
+    }
+
+    BufferPool::Local().Release(data_, capacity_);
+    data_ = new_data;
+    capacity_ = new_capacity;
+    head_ = 0;
+    tail_ = old_size;
+    return true;
+}
+
+std::span<char> RingBuffer::WritableSpan(size_t min_size) {
+    if (Empty()) {
+        head_ = tail_ = 0;
+    }
+
+    size_t wanted = std::min(Size() + min_size, max_capacity_);
+    if (!Reserve(wanted) || Size() == capacity_ || Size() >= max_capacity_) {
+        return {};
+    }
+
+    size_t tail_pos = tail_ & (capacity_ - 1);
+    size_t head_pos = head_ & (capacity_ - 1);
+    size_t contiguous = tail_pos >= head_pos ? capacity_ - tail_pos : head_pos - tail_pos;
+    contiguous = std::min(contiguous, max_capacity_ - Size());
+    return {data_ + tail_pos, contiguous};
+}
+
+std::span<const char> RingBuffer::ReadableSpan() const noexcept {
+    if (Empty()) {
+        return {};
+    }
+
+    size_t head_pos = head_ & (capacity_ - 1);
+    return {data_ + head_pos, std::min(Size(), capacity_ - head_pos)};
+}
+
+void RingBuffer::Consume(size_t size) noexcept {
+    head_ += std::min(size, Size());
+    if (Empty()) {
+        // Drained: an idle connection keeps no memory
+        Reset();
+    }
+}
+
+bool RingBuffer::Append(std::string_view data) {
+    if (Size() + data.size() > max_capacity_) {
+        return false;
+    }
+
+    while (!data.empty()) {
+        auto span = WritableSpan(data.size());
+        size_t chunk = std::min(span.size(), data.size());
+        std::memcpy(span.data(), data.data(), chunk);
+        Commit(chunk);
+        data.remove_prefix(chunk);
+    }
+
+    return true;
+}
+
+size_t RingBuffer::Find(char c, size_t from) const noexcept {
+    if (from >= Size()) {
+        return npos;
+    }
+
+    size_t offset = from;
+    size_t pos = head_ + from;
+    while (pos != tail_) {
+        size_t pos_masked = pos & (capacity_ - 1);
+        size_t chunk = std::min(tail_ - pos, capacity_ - pos_masked);
+        const void* found = std::memchr(data_ + pos_masked, c, chunk);
+        if (found) {
+            return offset + (static_cast<const char*>(found) - (data_ + pos_masked));
+        }
+        offset += chunk;
+        pos += chunk;
+    }
+
+    return npos;
+}
+
+void RingBuffer::Extract(size_t size, std::string& out) {
+    size = std::min(size, Size());
+    out.reserve(out.size() + size);
+    while (size > 0) {
+        auto chunk = ReadableSpan();
+        size_t taken = std::min(chunk.size(), size);
+        out.append(chunk.data(), taken);
+        size -= taken;
+        Consume(taken);
+    }
+}
+
+void RingBuffer::Peek(std::span<char> out) const noexcept {
+    size_t copied = 0;
+    while (copied < out.size()) {
+        size_t pos_masked = (head_ + copied) & (capacity_ - 1);
+        size_t chunk = std::min(out.size() - copied, capacity_ - pos_masked);
+        std::memcpy(out.data() + copied, data_ + pos_masked, chunk);
+        copied += chunk;
+    }
+}
+
+void RingBuffer::Reset() noexcept {
+    if (data_) {
+        BufferPool::Local().Release(data_, capacity_);
+    }
+
+    data_ = nullptr;
+    capacity_ = 0;
+    head_ = tail_ = 0;
+}
+}  // namespace redka::io
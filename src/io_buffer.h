@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace redka::io {
+    // Per-thread freelists of power-of-two byte blocks shared by all connection
+    // buffers, so that 10k mostly idle connections hold no memory while a busy
+    // one can still grow its buffers without hitting malloc on every request.
+    class BufferPool {
+    public:
+        static constexpr size_t kMinBlockShift = 12;  // 4 KiB
+        static constexpr size_t kNumClasses = 16;     // up to 128 MiB
+        static constexpr size_t kMaxCachedBytes = 64 << 20;
+
+        static BufferPool& Local() noexcept;
+
+        // Returns a block of at least `size` bytes, `size` is updated to the real capacity
+        char* Acquire(size_t& size);
+
+        void Release(char* block, size_t size) noexcept;
+
+        BufferPool() = default;
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        ~BufferPool();
+
+    private:
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        static size_t ClassOf(size_t size) noexcept;
+
+        std::array<FreeBlock*, kNumClasses> free_{};
+        size_t cached_bytes_{};
+    };
+
+    // Byte ring buffer that grows on demand up to `max_capacity` and hands its
+    // storage back to the BufferPool as soon as it drains.
+    class RingBuffer {
+    public:
+        static constexpr size_t npos = std::string::npos;
+
+        explicit RingBuffer(size_t max_capacity)
+            : max_capacity_(max_capacity) {
+        }
+
+        RingBuffer(const RingBuffer&) = delete;
+        RingBuffer& operator=(const RingBuffer&) = delete;
+
+        ~RingBuffer() {
+            Reset();
+        }
+
+        size_t Size() const noexcept {
+            return tail_ - head_;
+        }
+
+        bool Empty() const noexcept {
+            return head_ == tail_;
+        }
+
+        size_t Capacity() const noexcept {
+            return capacity_;
+        }
+
+        size_t MaxCapacity() const noexcept {
+            return max_capacity_;
+        }
+
+        // Contiguous free space after growing so that `min_size` more bytes fit
+        // (bounded by the cap). May be shorter when the free space wraps around;
+        // an empty span means the buffer is full
+        std::span<char> WritableSpan(size_t min_size = 1);
+
+        void Commit(size_t size) noexcept {
+            tail_ += size;
+        }
+
+        // Contiguous readable bytes from the front, the rest follows after Consume
+        std::span<const char> ReadableSpan() const noexcept;
+
+        void Consume(size_t size) noexcept;
+
+        // False if the data does not fit under the cap
+        bool Append(std::string_view data);
+
+        // Offset of the first `c` at or after `from` in readable data, npos if none
+        size_t Find(char c, size_t from = 0) const noexcept;
+
+        // Moves the first `size` readable bytes into `out`
+        void Extract(size_t size, std::string& out);
+
+        // Copies the first `out.size()` readable bytes, which must be there, without consuming them
+        void Peek(std::span<char> out) const noexcept;
+
+        // Drops the contents and returns the storage to the pool
+        void Reset() noexcept;
+
+    private:
+        bool Reserve(size_t size);
+
+        char* data_{};
+        size_t capacity_{};
+        size_t max_capacity_;
+        // Monotonic positions, masked by capacity_ - 1 on access
+        size_t head_{};
+        size_t tail_{};
+    };
+}
@@ -1,45 +1,215 @@
 #include <fcntl.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <charconv>
 #include <cstddef>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <random>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 #include "coro_task.h"
 #include "executor.h"
 #include "compact.h"
+#include "io_buffer.h"
 #include "mapped_file.h"
 #include "merge_records.h"
+#include "metrics.h"
 #include "net.h"
+#include "object_cache.h"
+#include "rdx_binary.h"
+#include "replication.h"
+#include "trace.h"
 #include "uuid_v4.h"
 
 using redka::io::Acceptor;
 using redka::io::CoroResult;
 using redka::io::Executor;
+using redka::io::ITask;
+using redka::io::RingBuffer;
 using redka::io::TcpSocket;
 
 const std::string WAL_FILENAME = "wal.log";
 // const size_t MAX_WAL_SIZE = 4ULL * 1024 * 1024 * 1024; // 4 GB
 const size_t MAX_WAL_SIZE = 1;
 bool wal_size_exceeded = false;
-LSMTree db;
+// Partitioned mode: shard i keeps its WAL in wal-<i>.log and its levels in
+// lsm_db/shard-<i>. The count is recorded here, data would be misrouted under another
+const std::string SHARD_COUNT_FILE = DB_DIR + "/SHARDS";
+const size_t MAX_SHARDS = 256;
 
 // Hash table: u128 -> std::tuple[size_t, size_t][4] (for records offsets and lengths for faster reading)
-std::unordered_map<std::string, std::array<std::pair<size_t, size_t>, 4>> recordIdToOffset{};
+using WALRecordsMetadata = std::array<std::pair<size_t, size_t>, 4>;
+// Offset of an unused slot in WALRecordsMetadata
+const size_t NO_WAL_OFFSET = -1u;
+
+// Independent partition of the keyspace: its own WAL and index (the memtable),
+// levels and compaction thread. Flushes and compactions of different shards
+// never wait for each other
+struct Shard {
+    MappedFile wal_log;
+    std::unordered_map<std::string, WALRecordsMetadata> recordIdToOffset{};
+    LSMTree db;
+    Executor::Clock::time_point last_write{};
+
+    Shard(const std::string &walFile, const std::string &dbDir) : wal_log(walFile), db(dbDir) {}
+};
+std::vector<std::unique_ptr<Shard>> shards;
 UUIDv4::UUIDGenerator<std::mt19937_64> uuidGenerator;
+size_t openConnections = 0;
+// A client that sends nothing, or reads none of its responses, this long is
+// disconnected; zero keeps connections forever
+const auto DEFAULT_IDLE_TIMEOUT = std::chrono::seconds(300);
+Executor::Clock::duration idleTimeout = DEFAULT_IDLE_TIMEOUT;
+// The WAL is not replayed on restart and moves to L0 only on the next write,
+// so a shard with no writes for this long has its WAL flushed by a background task
+const auto WAL_IDLE_FLUSH = std::chrono::seconds(1);
+// Ids of the async trace spans of requests
+uint64_t nextRequestId = 1;
 
 // Response codes, starting from 1: errors
 const int RDKAnone = 0;
 const int RDKAbad = 1;
 const int RDXbad = 2;
+// A follower takes no writes, and no reads while it is past its staleness bound
+const int RDKAreplica = 3;
+// Write refused at once because too many are already held by back-pressure
+const int RDKAbusy = 4;
+
+const std::string MULTI_GET_COMMAND = "MGET ";
+const std::string SCAN_COMMAND = "SCAN ";
+const std::string STATS_COMMAND = "STATS";
+const std::string PROMETHEUS_FORMAT = "PROMETHEUS";
+const std::string TRACE_COMMAND = "TRACE ";
+const std::string BATCH_COMMAND = "BATCH ";
+const size_t MAX_SCAN_LIMIT = 10000;
+const size_t MAX_BATCH_RECORDS = 10000;
+// The whole batch is held until it parses, so its text is capped as well
+const size_t MAX_BATCH_BYTES = 4 << 20;
+
+// Replication: a follower sends "REPLICATE <epoch> <seq>" and the connection
+// becomes the stream of writes after that position
+const std::string REPLICATE_COMMAND = "REPLICATE ";
+const std::string SNAPSHOT_HEADER = "SNAPSHOT ";
+// Recent writes kept for followers to resume from
+const size_t REPLICATION_LOG_BYTES = 64 << 20;
+// Entries sent to a follower between looks at the log, and snapshot records
+// read per page
+const size_t REPLICATION_BATCH_ENTRIES = 256;
+// How often the primary looks for new writes for a caught-up follower, and
+// how often it tells the follower it is caught up
+const auto REPLICATION_POLL_INTERVAL = std::chrono::milliseconds(2);
+const auto REPLICATION_HEARTBEAT = std::chrono::milliseconds(100);
+// Followers apply the stream in batches of at most this many writes
+const size_t REPLICA_APPLY_BATCH = 256;
+// A follower refuses reads once it has not been caught up for this long
+const auto REPLICA_MAX_STALENESS = std::chrono::seconds(2);
+const auto REPLICA_RECONNECT_DELAY = std::chrono::seconds(1);
+
+// Per-connection buffers grow on demand up to these caps and are recycled
+// through the BufferPool once drained
+const size_t MAX_REQUEST_SIZE = 1 << 20;
+const size_t MAX_RESPONSE_BUFFER = 1 << 20;
+const size_t READ_CHUNK_SIZE = 4 << 10;
+// Large responses are sent to the socket in chunks of this size
+const size_t RESPONSE_CHUNK_SIZE = 16 << 10;
+
+// Admission control. Past --max-connections a client is accepted, answered
+// with RDKAbusy and closed at once. The cap is also kept below what the
+// descriptor limit leaves after the storage (storageFds) and RESERVED_FDS
+// for the standard streams, the listening socket, the trace pipe, outgoing
+// connections and files opened in passing
+const size_t DEFAULT_MAX_CONNECTIONS = 768;
+const size_t RESERVED_FDS = 64;
+// The soft descriptor limit is raised to the hard one, up to this
+const size_t MAX_FD_LIMIT = 1 << 20;
+// How long the accept loop waits when accept fails, e.g. out of descriptors
+const auto ACCEPT_RETRY_DELAY = std::chrono::milliseconds(50);
+// Pipelined requests of one connection answered before its responses are
+// sent and the other connections get to run
+const size_t MAX_IN_FLIGHT_REQUESTS = 64;
+// Writes held by back-pressure at once. Past it a stall is a queue that only
+// grows, further writes are answered with RDKAbusy instead
+const size_t MAX_STALLED_WRITES = 256;
+size_t maxConnections = DEFAULT_MAX_CONNECTIONS;
+size_t fdLimit = 1024;
+size_t stalledWrites = 0;
+
+// Fully merged records of hot objects. Flushes and compactions only move data
+// between the WAL and the levels without changing the merge result, so only
+// writes have to touch it
+const size_t OBJECT_CACHE_BYTES = 64 << 20;
+ObjectCache objectCache(OBJECT_CACHE_BYTES);
+// Ids that exist nowhere: crawlers and retries of unknown ids are answered
+// with RDKAnone without probing the WAL and every SST
+const size_t NEGATIVE_CACHE_ENTRIES = 1 << 16;
+NegativeCache negativeCache(NEGATIVE_CACHE_ENTRIES);
+
+// Every write gets a sequence number here, followers (and their followers) tail it
+ReplicationLog replicationLog(REPLICATION_LOG_BYTES);
+size_t connectedReplicas = 0;
+
+// Follower mode: position in the primary's log applied so far
+struct ReplicaState {
+    bool enabled = false;
+    uint64_t epoch = 0;
+    uint64_t seq = 0;
+    // Last heartbeat that found the follower caught up
+    std::chrono::steady_clock::time_point caughtUpAt{};
+};
+ReplicaState replica;
+
+// A single shard keeps the unpartitioned layout
+void openShards(size_t count) {
+    if (count == 1) {
+        shards.push_back(std::make_unique<Shard>(WAL_FILENAME, DB_DIR));
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        shards.push_back(std::make_unique<Shard>("wal-" + std::to_string(i) + ".log",
+                                                 DB_DIR + "/shard-" + std::to_string(i)));
+    }
+}
+
+// False if the database was created with another shard count
+bool checkShardCount(size_t count) {
+    if (fs::exists(SHARD_COUNT_FILE)) {
+        std::ifstream in(SHARD_COUNT_FILE);
+        size_t recorded = 0;
+        return in >> recorded && recorded == count;
+    }
+    // An unpartitioned database has its levels right in DB_DIR
+    if (count == 1)
+        return true;
+    if (fs::exists(DB_DIR + "/L0"))
+        return false;
+    fs::create_directories(DB_DIR);
+    return writeFileDurably(SHARD_COUNT_FILE, std::to_string(count) + '\n');
+}
+
+// UUIDv4 low bits are random; ids that are not UUIDs are hashed
+size_t shardIndex(const std::string &recordId) {
+    if (shards.size() == 1)
+        return 0;
+    RecordKey recordKey;
+    uint64_t bits = parseRecordKey(recordId, recordKey) ? recordKey.lo : std::hash<std::string>{}(recordId);
+    return bits % shards.size();
+}
 
-MappedFile wal_log = MappedFile(WAL_FILENAME);
+Shard &shardFor(const std::string &recordId) {
+    return *shards[shardIndex(recordId)];
+}
 
 std::string readFromWALFileByOffset(MappedFile &mmapFile, const size_t recordOffset, const size_t recordLength) {
     if (recordOffset >= mmapFile.size()) {
@@ -50,75 +220,176 @@ std::string readFromWALFileByOffset(MappedFile &mmapFile, const size_t recordOff
     return std::string(recordStart, recordLength);
 }
 
-std::string readFromWALFileById(const std::string &recordId) {
+std::string mergeWALRecords(Shard &shard, const WALRecordsMetadata &recordsMetadata,
+                            const FieldProjection &projection = {}) {
     std::string mergedRecord;
-    auto recordsMetadata = recordIdToOffset[recordId];
     for (auto &recordMetadata : recordsMetadata) {
-        if (recordMetadata.first == -1)
+        if (recordMetadata.first == NO_WAL_OFFSET)
             break;
 
-        auto previousLogEntry = readFromWALFileByOffset(wal_log, recordMetadata.first, recordMetadata.second);
-        mergedRecord = mergeTwoRecords(mergedRecord, previousLogEntry);
+        auto logEntry = readFromWALFileByOffset(shard.wal_log, recordMetadata.first, recordMetadata.second);
+        // Newer entry goes first so it wins on equal versions
+        mergedRecord = mergeTwoRecords(logEntry, mergedRecord, projection);
     }
     return mergedRecord;
 }
 
+std::string readFromWALFileById(const std::string &recordId, const FieldProjection &projection = {}) {
+    TraceSpan span("wal_merge");
+    Shard &shard = shardFor(recordId);
+    auto it = shard.recordIdToOffset.find(recordId);
+    if (it == shard.recordIdToOffset.end())
+        return "";
+    return mergeWALRecords(shard, it->second, projection);
+}
+
+// Probes the index for the whole batch first and prefetches the log entries
+// it points to, so the merges find them in cache instead of stalling per id
+std::vector<std::string> readFromWALFileByIds(const std::vector<std::string> &recordIds) {
+    std::vector<const WALRecordsMetadata *> found(recordIds.size(), nullptr);
+    std::vector<Shard *> owners(recordIds.size());
+    for (size_t i = 0; i < recordIds.size(); ++i) {
+        Shard &shard = *(owners[i] = &shardFor(recordIds[i]));
+        auto it = shard.recordIdToOffset.find(recordIds[i]);
+        if (it == shard.recordIdToOffset.end())
+            continue;
+
+        found[i] = &it->second;
+        for (auto &recordMetadata : it->second) {
+            if (recordMetadata.first == NO_WAL_OFFSET || recordMetadata.first >= shard.wal_log.size())
+                break;
+            __builtin_prefetch(shard.wal_log.data() + recordMetadata.first);
+        }
+    }
+
+    std::vector<std::string> mergedRecords(recordIds.size());
+    for (size_t i = 0; i < recordIds.size(); ++i) {
+        if (found[i]) {
+            mergedRecords[i] = mergeWALRecords(*owners[i], *found[i]);
+        }
+    }
+    return mergedRecords;
+}
+
 void appendToWAL(MappedFile &mmapFile, const std::string &logEntry) {
+    TraceSpan span("wal_append");
+    LatencyTimer timer(Histogram::wal_append);
     mmapFile.append(logEntry + '\n');
+    countEvent(Counter::wal_bytes, logEntry.size() + 1);
 }
 
-// Function to write WAL to a log file
-void writeWALToFile(const std::string &logEntry, std::string const &recordId) {
-    if (wal_log.size() > MAX_WAL_SIZE) {
-        std::cout << "wal_log.size() > MAX_WAL_SIZE" << std::endl;
-        std::vector<std::pair<std::string, std::string>> batch;
-        for (const auto& [id, offsets] : recordIdToOffset) {
-            std::string record = readFromWALFileById(id);
-            if (!record.empty()) {
-                std::cout << "+ " << id << " " << record << std::endl;
-                batch.emplace_back(id, record);
-            }
+// Moves the shard's WAL into a new L0 file
+void flushWAL(Shard &shard) {
+    std::vector<std::pair<std::string, std::string>> batch;
+    for (const auto& [id, offsets] : shard.recordIdToOffset) {
+        std::string record = mergeWALRecords(shard, offsets);
+        if (!record.empty()) {
+            batch.emplace_back(id, record);
+        }
+    }
+
+    if (!batch.empty()) {
+        shard.db.flushBatchToL0(batch);
+    }
+
+    shard.wal_log.truncate();
+    shard.recordIdToOffset.clear();
+}
+
+void flushWALIfFull(Shard &shard) {
+    if (shard.wal_log.size() > MAX_WAL_SIZE) {
+        flushWAL(shard);
+    }
+}
+
+// Writes of one shard as one contiguous WAL append with a single sync. Writes
+// to the same id are merged first, the later one winning on equal versions, so
+// an id takes at most one slot of the index; an id with all four slots taken
+// gets its writes merged into one entry
+void writeShardBatch(Shard &shard, const std::vector<std::pair<std::string, std::string>> &writes) {
+    flushWALIfFull(shard);
+    shard.last_write = Executor::Clock::now();
+
+    std::vector<std::string> order;
+    std::unordered_map<std::string, std::string> entries;
+    for (const auto &[recordId, logEntry] : writes) {
+        auto [it, inserted] = entries.try_emplace(recordId, logEntry);
+        if (inserted) {
+            order.push_back(recordId);
+        } else {
+            it->second = "{@" + recordId + " " + mergeTwoRecords(logEntry, it->second) + "}";
+        }
+    }
+
+    // Offsets of the entries in `batch`, the index is updated once they are written
+    size_t batchOffset = shard.wal_log.size();
+    std::string batch;
+    std::vector<std::pair<size_t, size_t>> positions;
+    for (const auto &recordId : order) {
+        std::string &entry = entries[recordId];
+        auto it = shard.recordIdToOffset.find(recordId);
+        bool fourWritesAreTracked = it != shard.recordIdToOffset.end() && it->second.back().first != NO_WAL_OFFSET;
+        if (fourWritesAreTracked) {
+            entry = "{@" + recordId + " " + mergeTwoRecords(entry, mergeWALRecords(shard, it->second)) + "}";
         }
-        
         if (!batch.empty()) {
-            db.flushBatchToL0(batch);
+            batch += '\n';
         }
-        
-        wal_log.truncate();
-        recordIdToOffset.clear();
+        positions.emplace_back(batchOffset + batch.size(), entry.size());
+        batch += entry;
     }
+    appendToWAL(shard.wal_log, batch);
 
-    size_t newRecordOffset = wal_log.size();
-    if (recordIdToOffset.find(recordId) == recordIdToOffset.end()) {
-        appendToWAL(wal_log, logEntry);
-        recordIdToOffset[recordId] = {std::make_pair(newRecordOffset, logEntry.size()),
-                                      {-1u, 0}, {-1u, 0}, {-1u, 0}};
-    } else {
-        auto &recordsMetadata = recordIdToOffset[recordId];
-        bool fourWritesAreTracked = true;
+    for (size_t i = 0; i < order.size(); ++i) {
+        auto [it, inserted] = shard.recordIdToOffset.try_emplace(order[i]);
+        auto &recordsMetadata = it->second;
+        if (inserted || recordsMetadata.back().first != NO_WAL_OFFSET) {
+            recordsMetadata = {positions[i], {NO_WAL_OFFSET, 0}, {NO_WAL_OFFSET, 0}, {NO_WAL_OFFSET, 0}};
+            continue;
+        }
         for (auto &recordMetadata : recordsMetadata) {
             // no offset
-            if (recordMetadata.first == -1) {
-                recordMetadata.first = newRecordOffset;
-                recordMetadata.second = logEntry.size();
-                fourWritesAreTracked = false;
-                appendToWAL(wal_log, logEntry);
+            if (recordMetadata.first == NO_WAL_OFFSET) {
+                recordMetadata = positions[i];
                 break;
             }
         }
-        if (fourWritesAreTracked) {
-            // Merge all four writes and add it
-            std::string mergedRecord = logEntry;
-            mergedRecord = mergeTwoRecords(mergedRecord, readFromWALFileById(recordId));
-            std::stringstream new_record;
-            new_record << "{@" << recordId << " " << mergedRecord << "}";
-            recordIdToOffset[recordId] = {std::make_pair(newRecordOffset, new_record.str().size()),
-                                          {-1u, 0}, {-1u, 0}, {-1u, 0}};
-            appendToWAL(wal_log, new_record.str());
+    }
+}
+
+// Applies writes, (record id, log entry) pairs, with one WAL append per shard
+// they route to. The caches and the replication log see them only once the
+// WAL has them
+void writeBatchToWAL(const std::vector<std::pair<std::string, std::string>> &writes) {
+    if (shards.size() == 1) {
+        writeShardBatch(*shards[0], writes);
+    } else {
+        std::vector<std::vector<std::pair<std::string, std::string>>> shardWrites(shards.size());
+        for (const auto &write : writes) {
+            shardWrites[shardIndex(write.first)].push_back(write);
+        }
+        for (size_t i = 0; i < shards.size(); ++i) {
+            if (!shardWrites[i].empty()) {
+                writeShardBatch(*shards[i], shardWrites[i]);
+            }
+        }
+    }
+
+    for (const auto &[recordId, logEntry] : writes) {
+        RecordKey recordKey;
+        if (parseRecordKey(recordId, recordKey)) {
+            objectCache.applyWrite(recordKey, logEntry);
+            negativeCache.erase(recordKey);
         }
+        replicationLog.append(logEntry);
     }
 }
 
+// Function to write WAL to a log file
+void writeWALToFile(const std::string &logEntry, std::string const &recordId) {
+    writeBatchToWAL({{recordId, logEntry}});
+}
+
 bool isCorrectParentheses(char firstSymbol, char secondSymbol) {
     if ((firstSymbol == '{' && secondSymbol != '}') || (firstSymbol != '{' && secondSymbol == '}'))
         return false;
@@ -134,7 +405,8 @@ bool isCorrectParentheses(char firstSymbol, char secondSymbol) {
 //    {@1 {<@2 address,"Wonderland">}} | {@1 {<address,"Home"> <name, "Alice">}}
 // or even (mixed case)
 //    {@1 {<address,"Home"> name:"Alice"}}
-// For merge to work correctly (so value always must be in {} brackets)
+// For merge to work correctly (so value always must be in {} brackets).
+// Field versions and names are checked here, a write that gets past it merges cleanly
 bool parseWriteMessage(const std::string &message, std::string &objectData, bool &isUpdate, std::string &updateIndex) {
     // As record ID is not a version, we are introducing special format for
     // queries including it We demand that message starts and ends with "{" and
@@ -165,13 +437,42 @@ bool parseWriteMessage(const std::string &message, std::string &objectData, bool
             record = message.substr(spacePos + 1, message.size() - spacePos - 2);
         }
         objectData = message.substr(0, spacePos + 1) + record + "}";
-        return true;
+        return checkRecordFields(record);
     }
 
     // New object writes must be either {...} or <...>
     if (!isCorrectParentheses(*message.begin(), *(message.end() - 1)))
         return false;
     objectData = message;
+    return checkRecordFields(message);
+}
+
+// Read query: "<id>" for the whole record, "<id> <field>,<field>,..." for
+// just these fields
+bool parseReadQuery(const std::string &query, std::string &recordId, FieldProjection &projection) {
+    size_t spacePos = query.find(' ');
+    recordId = query.substr(0, spacePos);
+    if (spacePos == std::string::npos)
+        return true;
+
+    auto isWordChar = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; };
+    std::vector<FieldId> fields;
+    std::string_view list = std::string_view(query).substr(spacePos + 1);
+    while (true) {
+        size_t comma = list.find(',');
+        std::string_view name = list.substr(0, comma);
+        if (name.empty() || !std::all_of(name.begin(), name.end(), isWordChar))
+            return false;
+        // Every written name is interned, one that is not is in no record
+        FieldId field = 0;
+        if (findField(name, field)) {
+            fields.push_back(field);
+        }
+        if (comma == std::string_view::npos)
+            break;
+        list.remove_prefix(comma + 1);
+    }
+    projection = FieldProjection(std::move(fields));
     return true;
 }
 
@@ -186,125 +487,1628 @@ bool parseMessage(const std::string &message, std::string &objectData, bool &isR
     return parseWriteMessage(message, objectData, isUpdate, updateIndex);
 }
 
-std::string readFromSSTFileById(const std::string& recordId) {
-    std::string sstData = db.get(recordId);
-    sstData = '{' + sstData + '}';
-    return sstData;
+std::string readFromSSTFileById(const std::string& recordId, const FieldProjection &projection = {}) {
+    std::string sstData = shardFor(recordId).db.get(recordId, projection);
+    if (sstData.empty())
+        return "";
+    return '{' + sstData + '}';
 }
 
-std::string readRecordById(const std::string& recordId) {
-    std::cout << recordId << std::endl;
-    std::string walData = readFromWALFileById(recordId);
-    
-    std::string sstData = readFromSSTFileById(recordId);
-
-    std::string merged = mergeTwoRecords(walData, sstData);
+// Fields of a cached record in `projection`, null if it has none of them
+std::shared_ptr<const MergeMap> projectRecord(const MergeMap &record, const FieldProjection &projection) {
+    MergeMap projected;
+    for (const auto &[field, value] : record) {
+        if (projection.contains(field)) {
+            projected.emplace(field, value);
+        }
+    }
+    return projected.empty() ? nullptr : std::make_shared<const MergeMap>(std::move(projected));
+}
 
-    std::cout << walData << " " << sstData << " " << merged << std::endl;
+// Null if the record exists nowhere, or has none of the projected fields
+std::shared_ptr<const MergeMap> readRecordById(const std::string& recordId, const FieldProjection &projection = {}) {
+    RecordKey recordKey;
+    bool cacheable = parseRecordKey(recordId, recordKey);
+    if (cacheable) {
+        if (negativeCache.contains(recordKey)) {
+            return nullptr;
+        }
+        if (auto cached = objectCache.lookup(recordKey)) {
+            return projection.selectsAll() ? cached : projectRecord(*cached, projection);
+        }
+    }
 
-    return merged;
+    std::string walData = readFromWALFileById(recordId, projection);
+    std::string sstData = readFromSSTFileById(recordId, projection);
+    auto record = std::make_shared<const MergeMap>(mergeTwoRecordsToMap(walData, sstData, projection));
+    // A projected record is partial: it is not cached, and being empty does
+    // not mean the id is unknown
+    if (!projection.selectsAll()) {
+        return record->empty() ? nullptr : record;
+    }
+    if (record->empty()) {
+        if (cacheable) {
+            negativeCache.insert(recordKey);
+        }
+        return nullptr;
+    }
+    if (cacheable) {
+        objectCache.insert(recordKey, record);
+    }
+    return record;
 }
 
-// Handle the client connection
-CoroResult<void> handleClient(TcpSocket socket) {
-    std::array<char, 1024> buffer;
+// Sorted ids split by shard keep their order, so each shard gets one sorted
+// multiGet; results are in the order of `sortedIds`
+std::vector<std::string> multiGetFromShards(const std::vector<std::string> &sortedIds) {
+    if (shards.size() == 1)
+        return shards[0]->db.multiGet(sortedIds);
 
-    while (true) {
-        size_t bytesRead = co_await socket.ReadSome(buffer);
-        if (bytesRead <= 0) {
-            co_await socket.WriteAll(std::span(std::to_string(RDKAbad).c_str(), 1));
-            break;
+    std::vector<std::vector<std::string>> shardIds(shards.size());
+    std::vector<std::vector<size_t>> positions(shards.size());
+    for (size_t i = 0; i < sortedIds.size(); ++i) {
+        size_t shard = shardIndex(sortedIds[i]);
+        shardIds[shard].push_back(sortedIds[i]);
+        positions[shard].push_back(i);
+    }
+
+    std::vector<std::string> results(sortedIds.size());
+    for (size_t shard = 0; shard < shards.size(); ++shard) {
+        if (shardIds[shard].empty())
+            continue;
+        std::vector<std::string> shardResults = shards[shard]->db.multiGet(shardIds[shard]);
+        for (size_t i = 0; i < shardResults.size(); ++i) {
+            results[positions[shard][i]] = std::move(shardResults[i]);
         }
+    }
+    return results;
+}
 
-        std::string message(buffer.begin(), buffer.begin() + bytesRead);
-        std::string idOrRecord;
-        bool isRead = false;
-        bool isUpdate = false;
-        std::string idOfRecordToUpdate;
+// Resolves a batch of ids: cache hits first, then the misses with one sorted
+// pass over the WAL index and each SST; records are in the order of `recordIds`,
+// null for ids that exist nowhere
+std::vector<std::shared_ptr<const MergeMap>> readRecordsByIds(const std::vector<std::string> &recordIds) {
+    std::vector<std::shared_ptr<const MergeMap>> records(recordIds.size());
+    std::vector<bool> resolved(recordIds.size(), false);
+    std::vector<std::string> sortedIds;
+    for (size_t i = 0; i < recordIds.size(); ++i) {
+        RecordKey recordKey;
+        if (parseRecordKey(recordIds[i], recordKey)) {
+            resolved[i] = negativeCache.contains(recordKey);
+            if (!resolved[i]) {
+                records[i] = objectCache.lookup(recordKey);
+                resolved[i] = records[i] != nullptr;
+            }
+        }
+        if (!resolved[i]) {
+            sortedIds.push_back(recordIds[i]);
+        }
+    }
+    std::sort(sortedIds.begin(), sortedIds.end());
+    sortedIds.erase(std::unique(sortedIds.begin(), sortedIds.end()), sortedIds.end());
 
-        bool gorParseError = false;
-        try {
-            if (!parseMessage(message, idOrRecord, isRead, isUpdate, idOfRecordToUpdate)) {
-                co_await socket.WriteAll(std::span(std::to_string(RDKAbad).c_str(), 1));
-                break;
+    std::vector<std::string> walData = readFromWALFileByIds(sortedIds);
+    std::vector<std::string> sstData = multiGetFromShards(sortedIds);
+
+    std::vector<std::shared_ptr<const MergeMap>> sortedRecords;
+    sortedRecords.reserve(sortedIds.size());
+    for (size_t i = 0; i < sortedIds.size(); ++i) {
+        std::shared_ptr<const MergeMap> record;
+        if (!walData[i].empty() || !sstData[i].empty()) {
+            record = std::make_shared<const MergeMap>(mergeTwoRecordsToMap(walData[i], '{' + sstData[i] + '}'));
+        }
+        RecordKey recordKey;
+        if (parseRecordKey(sortedIds[i], recordKey)) {
+            if (record) {
+                objectCache.insert(recordKey, record);
+            } else {
+                negativeCache.insert(recordKey);
             }
-        } catch (...) {
-            gorParseError = true;
-            // 'co_await' cannot be used in the handler of a try block
         }
-        if (gorParseError) {
-            co_await socket.WriteAll(std::span(std::to_string(RDXbad).c_str(), 1));
-            break;
+        sortedRecords.push_back(std::move(record));
+    }
+
+    for (size_t i = 0; i < recordIds.size(); ++i) {
+        if (!resolved[i]) {
+            size_t pos = std::lower_bound(sortedIds.begin(), sortedIds.end(), recordIds[i]) - sortedIds.begin();
+            records[i] = sortedRecords[pos];
         }
+    }
+    return records;
+}
 
-        // Read query
-        if (isRead) {
-            // Check if is correct UUID by trying to parse it
-            bool gotUnclearID = false;
-            try {
-                UUIDv4::UUID::fromStrFactory(idOrRecord);
-            } catch (...) {
-                gotUnclearID = true;
+// Multi-get query: "MGET <id> <id> ...", answered with one record per line
+bool parseMultiGetMessage(const std::string &message, std::vector<std::string> &recordIds) {
+    std::stringstream ss(message.substr(MULTI_GET_COMMAND.size()));
+    std::string recordId;
+    while (ss >> recordId) {
+        recordIds.push_back(recordId);
+    }
+    return !recordIds.empty();
+}
+
+// Batch write: "BATCH <count>", then `count` lines with a new object or an
+// {@id ...} update each. Answered with the ids, one per line in order
+bool parseBatchMessage(const std::string &message, size_t &count) {
+    std::string token = message.substr(BATCH_COMMAND.size());
+    if (token.empty() || token.size() > 9 || !std::all_of(token.begin(), token.end(), ::isdigit))
+        return false;
+    count = std::stoul(token);
+    return count > 0 && count <= MAX_BATCH_RECORDS;
+}
+
+struct ScanQuery {
+    // [from, to), empty is unbounded
+    std::string from;
+    std::string to;
+    size_t limit = 0;
+    // Last id returned by the previous page, the scan resumes after it
+    std::string cursor;
+};
+
+bool parseScanLimit(const std::string &token, size_t &limit) {
+    if (token.empty() || token.size() > 9 || !std::all_of(token.begin(), token.end(), ::isdigit))
+        return false;
+    limit = std::stoul(token);
+    return limit > 0 && limit <= MAX_SCAN_LIMIT;
+}
+
+// Smallest string greater than every string with this prefix, empty if none
+std::string prefixUpperBound(std::string prefix) {
+    while (!prefix.empty() && static_cast<unsigned char>(prefix.back()) == 0xff) {
+        prefix.pop_back();
+    }
+    if (!prefix.empty()) {
+        ++prefix.back();
+    }
+    return prefix;
+}
+
+// Range scan: "SCAN <from> <to> <limit> [<cursor>]", '*' is an open bound
+// Prefix scan: "SCAN <prefix>* <limit> [<cursor>]"
+bool parseScanMessage(const std::string &message, ScanQuery &query) {
+    std::stringstream ss(message.substr(SCAN_COMMAND.size()));
+    std::vector<std::string> tokens;
+    std::string token;
+    while (ss >> token) {
+        tokens.push_back(token);
+    }
+
+    bool isPrefix = tokens.size() >= 2 && tokens.size() <= 3 && tokens[0].size() > 1 && tokens[0].back() == '*' &&
+                    parseScanLimit(tokens[1], query.limit);
+    if (isPrefix) {
+        query.from = tokens[0].substr(0, tokens[0].size() - 1);
+        query.to = prefixUpperBound(query.from);
+        query.cursor = tokens.size() == 3 ? tokens[2] : "";
+        return true;
+    }
+
+    if (tokens.size() < 3 || tokens.size() > 4 || !parseScanLimit(tokens[2], query.limit))
+        return false;
+    query.from = tokens[0] == "*" ? "" : tokens[0];
+    query.to = tokens[1] == "*" ? "" : tokens[1];
+    query.cursor = tokens.size() == 4 ? tokens[3] : "";
+    return true;
+}
+
+// Ordered scan merging the WAL indexes with the LSM iterators over all levels
+// of every shard. Returns up to `limit` records; `more` is set if the range
+// may hold more.
+std::vector<std::pair<std::string, MergeMap>> scanRecords(const ScanQuery &query, bool &more) {
+    std::string start = std::max(query.from, query.cursor);
+    auto inRange = [&](const std::string &key) {
+        return key >= start && key != query.cursor && (query.to.empty() || key < query.to);
+    };
+
+    // The WAL index is unordered: take a sorted snapshot of the range. It only
+    // holds the writes since the last flush, so this stays small
+    std::vector<std::string> walKeys;
+    for (const auto &shard : shards) {
+        for (const auto &[id, offsets] : shard->recordIdToOffset) {
+            if (inRange(id)) {
+                walKeys.push_back(id);
             }
-            if (gotUnclearID) {
-                co_await socket.WriteAll(std::span(std::to_string(RDKAbad).c_str(), 1));
-                break;
+        }
+    }
+    std::sort(walKeys.begin(), walKeys.end());
+
+    std::vector<LSMIterator> sstIts;
+    for (const auto &shard : shards) {
+        LSMIterator it = shard->db.newIterator();
+        it.setUpperBound(query.to);
+        it.seek(start);
+        if (it.valid() && it.key() == query.cursor) {
+            it.next();
+        }
+        sstIts.push_back(std::move(it));
+    }
+    // Shards hold disjoint keys, the next one is the smallest of their current keys
+    auto nextSST = [&sstIts]() -> LSMIterator * {
+        LSMIterator *smallest = nullptr;
+        for (auto &it : sstIts) {
+            if (it.valid() && (!smallest || it.key() < smallest->key())) {
+                smallest = &it;
             }
+        }
+        return smallest;
+    };
 
-            // Key not found
-            // if (recordIdToOffset.find(idOrRecord) == recordIdToOffset.end()) {
-            //     co_await socket.WriteAll(std::span(std::to_string(RDKAnone).c_str(), 1));
-            //     break;
-            // }
-            auto requestedRecord = readRecordById(idOrRecord);
-            co_await socket.WriteAll(std::span(requestedRecord.c_str(), requestedRecord.length()));
-            break;
+    std::vector<std::pair<std::string, MergeMap>> records;
+    size_t walPos = 0;
+    LSMIterator *sstIt = nextSST();
+    while (records.size() < query.limit && (walPos < walKeys.size() || sstIt)) {
+        bool fromWAL = walPos < walKeys.size() && (!sstIt || walKeys[walPos] <= sstIt->key());
+        bool fromSST = sstIt && (walPos == walKeys.size() || sstIt->key() <= walKeys[walPos]);
+
+        std::string recordId = fromWAL ? walKeys[walPos] : sstIt->key();
+        std::string walData = fromWAL ? readFromWALFileById(recordId) : "";
+        std::string sstData = fromSST ? '{' + sstIt->value() + '}' : "";
+        MergeMap record = mergeTwoRecordsToMap(walData, sstData);
+        if (!record.empty()) {
+            records.emplace_back(std::move(recordId), std::move(record));
         }
 
-        if (!isUpdate) {
-            // Create query
-            UUIDv4::UUID uuid = uuidGenerator.getUUID();
-            std::string newID = uuid.str();
-            std::stringstream walEntry;
-            walEntry << "{@" << newID << " " << idOrRecord << "}";
-            writeWALToFile(walEntry.str(), newID);
-            co_await socket.WriteAll(std::span(newID.c_str(), newID.length()));
-        } else {
-            // Update query
-            writeWALToFile(idOrRecord, idOfRecordToUpdate);
-            co_await socket.WriteAll(std::span(idOfRecordToUpdate.c_str(), idOfRecordToUpdate.length()));
+        if (fromWAL) {
+            ++walPos;
+        }
+        if (fromSST) {
+            sstIt->next();
+            sstIt = nextSST();
         }
     }
+
+    more = walPos < walKeys.size() || sstIt;
+    return records;
 }
 
-// Set up the server and listen for client connections
-void startServer() {
-    using redka::io::Acceptor;
-    using redka::io::Executor;
+enum class TraceAction {
+    on,
+    off,
+    dump,
+};
 
-    struct sockaddr_in serverAddr, clientAddr;
-    socklen_t addrLen = sizeof(clientAddr);
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(8080);
+// "TRACE ON <N>" traces every N-th request, "TRACE OFF", "TRACE DUMP" has
+// the trace rings written to a file
+bool parseTraceMessage(const std::string &message, TraceAction &action, uint32_t &sampling) {
+    std::stringstream ss(message.substr(TRACE_COMMAND.size()));
+    std::vector<std::string> tokens;
+    std::string token;
+    while (ss >> token) {
+        tokens.push_back(token);
+    }
+
+    if (tokens.size() == 1 && (tokens[0] == "OFF" || tokens[0] == "DUMP")) {
+        action = tokens[0] == "OFF" ? TraceAction::off : TraceAction::dump;
+        return true;
+    }
+    if (tokens.size() != 2 || tokens[0] != "ON" || tokens[1].empty() || tokens[1].size() > 9 ||
+        !std::all_of(tokens[1].begin(), tokens[1].end(), ::isdigit))
+        return false;
+    action = TraceAction::on;
+    sampling = std::stoul(tokens[1]);
+    return sampling > 0;
+}
 
-    auto acceptor = Acceptor::ListenOn(serverAddr);
+enum class RequestStatus {
+    ok,
+    closed,
+    tooLarge,
+};
 
-    Executor executor(acceptor.get());
+// Runs a read or write of a client under the idle timeout. One that times out
+// shuts the connection down and reports 0 bytes, like a closed connection
+CoroResult<size_t> withIdleTimeout(TcpSocket &socket, CoroResult<size_t> &&op) {
+    if (idleTimeout == Executor::Clock::duration::zero()) {
+        co_return co_await std::move(op);
+    }
+    auto bytes = co_await redka::io::WithTimeout(std::move(op), idleTimeout, [&socket] { socket.Shutdown(); });
+    if (!bytes) {
+        countEvent(Counter::idle_disconnects);
+        co_return 0;
+    }
+    co_return *bytes;
+}
 
-    auto acceptTask = [](Executor *executor, Acceptor *acceptor) -> redka::io::CoroResult<void> {
-        std::cout << "Server listening on port 8080" << std::endl;
-        for (;;) {
-            executor->Schedule(handleClient(co_await acceptor->Accept()).fire_and_forgive());
+// Requests are separated by newlines (JDR); reads one request into `message`
+CoroResult<RequestStatus> readRequest(TcpSocket &socket, RingBuffer &input, std::string &message) {
+    size_t scanned = 0;
+    size_t lineEnd;
+    while ((lineEnd = input.Find('\n', scanned)) == RingBuffer::npos) {
+        scanned = input.Size();
+        auto span = input.WritableSpan(READ_CHUNK_SIZE);
+        if (span.empty()) {
+            co_return RequestStatus::tooLarge;
         }
-        co_return;
-    }(&executor, acceptor.get());
+        size_t bytesRead = co_await withIdleTimeout(socket, socket.ReadSome(span));
+        if (bytesRead == 0) {
+            co_return RequestStatus::closed;
+        }
+        input.Commit(bytesRead);
+    }
 
-    executor.Schedule(&acceptTask);
-    executor.Run();
+    message.clear();
+    input.Extract(lineEnd, message);
+    input.Consume(1);
+    if (!message.empty() && message.back() == '\r') {
+        message.pop_back();
+    }
+    co_return RequestStatus::ok;
+}
+
+// Reads until `size` bytes are buffered; false if the connection closes first
+CoroResult<bool> fillInput(TcpSocket &socket, RingBuffer &input, size_t size) {
+    while (input.Size() < size) {
+        auto span = input.WritableSpan(std::max(READ_CHUNK_SIZE, size - input.Size()));
+        if (span.empty()) {
+            co_return false;
+        }
+        size_t bytesRead = co_await withIdleTimeout(socket, socket.ReadSome(span));
+        if (bytesRead == 0) {
+            co_return false;
+        }
+        input.Commit(bytesRead);
+    }
+    co_return true;
+}
+
+// Whether a whole binary frame is buffered
+bool hasRdxFrame(const RingBuffer &input) {
+    if (input.Size() < RDX_FRAME_HEADER_SIZE) {
+        return false;
+    }
+    char bytes[RDX_FRAME_HEADER_SIZE];
+    input.Peek(bytes);
+    return input.Size() - RDX_FRAME_HEADER_SIZE >= decodeFrameHeader(bytes).length;
+}
+
+// Reads one binary frame into `header` and `payload`
+CoroResult<RequestStatus> readRdxFrame(TcpSocket &socket, RingBuffer &input, RdxFrameHeader &header,
+                                       std::string &payload) {
+    if (!co_await fillInput(socket, input, RDX_FRAME_HEADER_SIZE)) {
+        co_return RequestStatus::closed;
+    }
+    char bytes[RDX_FRAME_HEADER_SIZE];
+    input.Peek(bytes);
+    header = decodeFrameHeader(bytes);
+    if (header.length > input.MaxCapacity() - RDX_FRAME_HEADER_SIZE) {
+        co_return RequestStatus::tooLarge;
+    }
+    if (!co_await fillInput(socket, input, RDX_FRAME_HEADER_SIZE + header.length)) {
+        co_return RequestStatus::closed;
+    }
+    input.Consume(RDX_FRAME_HEADER_SIZE);
+    payload.clear();
+    input.Extract(header.length, payload);
+    co_return RequestStatus::ok;
+}
+
+CoroResult<bool> flushResponse(TcpSocket &socket, RingBuffer &output) {
+    while (!output.Empty()) {
+        size_t bytesWritten = co_await withIdleTimeout(socket, socket.WriteSome(output.ReadableSpan()));
+        if (bytesWritten == 0) {
+            co_return false;
+        }
+        output.Consume(bytesWritten);
+    }
+    co_return true;
+}
+
+// Buffers a part of a response and sends it once a whole chunk is accumulated
+CoroResult<bool> writeResponse(TcpSocket &socket, RingBuffer &output, std::string_view part) {
+    if (output.Size() + part.size() > output.MaxCapacity()) {
+        if (!co_await flushResponse(socket, output)) {
+            co_return false;
+        }
+        if (part.size() > output.MaxCapacity()) {
+            size_t bytesWritten =
+                co_await withIdleTimeout(socket, socket.WriteAll(std::span(part.data(), part.size())));
+            co_return bytesWritten == part.size();
+        }
+    }
+
+    output.Append(part);
+    if (output.Size() >= RESPONSE_CHUNK_SIZE) {
+        co_return co_await flushResponse(socket, output);
+    }
+    co_return true;
+}
+
+CoroResult<bool> writeResponseCode(TcpSocket &socket, RingBuffer &output, int code) {
+    co_return co_await writeResponse(socket, output, std::to_string(code) + '\n');
+}
+
+enum class WriteSlot {
+    granted,
+    busy,
+    closed,
+};
+
+// Holds a write while the shard's LSM tree asks for back-pressure (L0 over its
+// slowdown trigger, flushes over their write budget). Responses to earlier
+// pipelined requests are sent first so they do not wait with it
+CoroResult<WriteSlot> waitForWriteSlot(TcpSocket &socket, RingBuffer &output, Shard &shard) {
+    auto delay = shard.db.writeDelay();
+    if (delay.count() == 0) {
+        co_return WriteSlot::granted;
+    }
+    if (stalledWrites >= MAX_STALLED_WRITES) {
+        countEvent(Counter::busy_rejections);
+        co_return WriteSlot::busy;
+    }
+    if (!co_await flushResponse(socket, output)) {
+        co_return WriteSlot::closed;
+    }
+    countEvent(Counter::write_stalls);
+    ++stalledWrites;
+    for (; delay.count() > 0; delay = shard.db.writeDelay()) {
+        co_await redka::io::SleepFor(delay);
+        countEvent(Counter::write_stall_micros, delay.count());
+    }
+    --stalledWrites;
+    co_return WriteSlot::granted;
+}
+
+// Creates a record from "{...}", or applies an update "{@id {...}}" of
+// `recordId`, once the shard takes writes. A create draws its id into `recordId`
+CoroResult<WriteSlot> writeSingleRecord(TcpSocket &socket, RingBuffer &output, bool isUpdate, const std::string &record,
+                                        std::string &recordId, bool sampled) {
+    // Stalls count towards the write latency, the client sees them
+    LatencyTimer timer(isUpdate ? Histogram::update : Histogram::create);
+    countEvent(isUpdate ? Counter::updates : Counter::creates);
+    // A new id is drawn first, it decides the shard that has to take the write
+    if (!isUpdate) {
+        recordId = uuidGenerator.getUUID().str();
+    }
+    WriteSlot slot = co_await waitForWriteSlot(socket, output, shardFor(recordId));
+    if (slot != WriteSlot::granted) {
+        co_return slot;
+    }
+
+    TraceScope scope(sampled);
+    writeWALToFile(isUpdate ? record : "{@" + recordId + " " + record + "}", recordId);
+    co_return WriteSlot::granted;
+}
+
+// Flushes the WALs of shards that have gone quiet, bounding the writes a
+// restart loses to the last WAL_IDLE_FLUSH
+CoroResult<void> flushIdleWALs() {
+    for (;;) {
+        co_await redka::io::SleepFor(WAL_IDLE_FLUSH);
+        auto now = Executor::Clock::now();
+        for (auto &shard : shards) {
+            if (shard->wal_log.size() > 0 && now - shard->last_write >= WAL_IDLE_FLUSH) {
+                flushWAL(*shard);
+                countEvent(Counter::wal_idle_flushes);
+            }
+        }
+    }
+}
+
+// Descriptors the shards may hold at once: their WALs and LSM trees
+size_t storageFds() {
+    size_t fds = 0;
+    for (const auto &shard : shards) {
+        fds += 1 + shard->db.maxOpenFiles();
+    }
+    return fds;
+}
+
+// Clients served at once: --max-connections, or fewer if the storage has
+// grown into the descriptors it leaves
+size_t connectionCap() {
+    size_t used = RESERVED_FDS + storageFds();
+    return used >= fdLimit ? 0 : std::min(maxConnections, fdLimit - used);
+}
+
+// The soft RLIMIT_NOFILE, raised to the hard one first
+size_t raiseFdLimit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return fdLimit;
+    rlim_t wanted = std::min<rlim_t>(limit.rlim_max, MAX_FD_LIMIT);
+    if (limit.rlim_cur < wanted) {
+        rlimit raised = limit;
+        raised.rlim_cur = wanted;
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+            limit = raised;
+        }
+    }
+    return std::min<rlim_t>(limit.rlim_cur, MAX_FD_LIMIT);
+}
+
+// A client over the connection cap gets RDKAbusy, in JDR whatever it meant
+// to speak, instead of a wait in the listen backlog
+CoroResult<void> rejectClient(TcpSocket socket) {
+    countEvent(Counter::busy_connections);
+    std::string response = std::to_string(RDKAbusy) + '\n';
+    co_await socket.WriteAll(std::span(response.data(), response.size()));
+}
+
+// "{field@ver:value ...}\n", "{@id field@ver:value ...}\n" with an id
+void appendRecordLine(std::string &out, const MergeMap &record, std::string_view recordId = {}) {
+    out += '{';
+    if (!recordId.empty()) {
+        out += '@';
+        out += recordId;
+        out += record.empty() ? "" : " ";
+    }
+    bool first = true;
+    for (auto it : fieldsByName(record)) {
+        if (!first) {
+            out += ' ';
+        }
+        first = false;
+        appendFieldToRecord(out, fieldName(it->first), it->second.first, it->second.second);
+    }
+    out += "}\n";
 }
 
-int main() {
-    startServer();
+CoroResult<bool> writeRecord(TcpSocket &socket, RingBuffer &output, const MergeMap &record) {
+    std::string part;
+    appendRecordLine(part, record);
+    co_return co_await writeResponse(socket, output, part);
+}
+
+bool parseUint64(std::string_view token, uint64_t &value) {
+    auto [end, error] = std::from_chars(token.data(), token.data() + token.size(), value);
+    return !token.empty() && error == std::errc() && end == token.data() + token.size();
+}
+
+// "<epoch> <seq>" of REPLICATE and SNAPSHOT lines
+bool parseReplicationPosition(std::string_view text, uint64_t &epoch, uint64_t &seq) {
+    size_t spacePos = text.find(' ');
+    return spacePos != std::string_view::npos && parseUint64(text.substr(0, spacePos), epoch) &&
+           parseUint64(text.substr(spacePos + 1), seq);
+}
+
+// "{@id {...}}", a write that recreates the record when merged
+std::string recordToEntry(const std::string &recordId, const MergeMap &record) {
+    std::string entry = "{@" + recordId + " {";
+    bool first = true;
+    for (auto it : fieldsByName(record)) {
+        if (!first) {
+            entry += ' ';
+        }
+        first = false;
+        appendFieldToRecord(entry, fieldName(it->first), it->second.first, it->second.second);
+    }
+    return entry + "}}";
+}
+
+// "SNAPSHOT <epoch> <seq>", then every record as a write that recreates it.
+// Writes made while it is sent may be in it or not: the stream after <seq>
+// repeats them, and merging a write twice changes nothing
+CoroResult<bool> sendSnapshot(TcpSocket &socket, RingBuffer &output, uint64_t epoch, uint64_t seq) {
+    countEvent(Counter::replica_snapshots);
+    std::string header = SNAPSHOT_HEADER + std::to_string(epoch) + ' ' + std::to_string(seq) + '\n';
+    if (!co_await writeResponse(socket, output, header)) {
+        co_return false;
+    }
+
+    ScanQuery query;
+    query.limit = REPLICATION_BATCH_ENTRIES;
+    bool more = true;
+    while (more) {
+        std::vector<std::pair<std::string, MergeMap>> records = scanRecords(query, more);
+        if (records.empty()) {
+            break;
+        }
+        for (const auto &[recordId, record] : records) {
+            if (!co_await writeResponse(socket, output, recordToEntry(recordId, record) + '\n')) {
+                co_return false;
+            }
+        }
+        query.cursor = records.back().first;
+    }
+    co_return true;
+}
+
+// Ships the replication log to a follower that applied everything up to
+// (epoch, seq): a snapshot first if the log cannot serve it, then every new
+// write as "<seq> <entry>". A caught-up follower gets "<seq>" heartbeats
+CoroResult<void> streamReplication(TcpSocket &socket, RingBuffer &output, uint64_t epoch, uint64_t seq) {
+    auto lastHeartbeat = std::chrono::steady_clock::time_point{};
+    while (true) {
+        if (!replicationLog.canResumeFrom(epoch, seq)) {
+            epoch = replicationLog.epoch();
+            seq = replicationLog.lastSeq();
+            if (!co_await sendSnapshot(socket, output, epoch, seq)) {
+                co_return;
+            }
+        }
+
+        // Entries may be dropped from the log while a send is suspended
+        for (size_t sent = 0; sent < REPLICATION_BATCH_ENTRIES && replicationLog.canResumeFrom(epoch, seq) &&
+                              seq < replicationLog.lastSeq();
+             ++sent) {
+            std::string part = std::to_string(seq + 1) + ' ' + replicationLog.entry(seq + 1) + '\n';
+            if (!co_await writeResponse(socket, output, part)) {
+                co_return;
+            }
+            ++seq;
+            countEvent(Counter::replicated_entries);
+        }
+
+        bool caughtUp = seq == replicationLog.lastSeq();
+        auto now = std::chrono::steady_clock::now();
+        if (caughtUp && now - lastHeartbeat >= REPLICATION_HEARTBEAT) {
+            if (!co_await writeResponse(socket, output, std::to_string(seq) + '\n')) {
+                co_return;
+            }
+            lastHeartbeat = now;
+        }
+        if (!co_await flushResponse(socket, output)) {
+            co_return;
+        }
+        if (caughtUp) {
+            co_await redka::io::SleepFor(REPLICATION_POLL_INTERVAL);
+        }
+    }
+}
+
+// Log entries are "{@<id> ...}"
+bool addReplicatedWrite(std::vector<std::pair<std::string, std::string>> &writes, std::string entry) {
+    size_t spacePos = entry.find(' ');
+    if (!entry.starts_with("{@") || spacePos == std::string::npos)
+        return false;
+    std::string recordId = entry.substr(2, spacePos - 2);
+    writes.emplace_back(std::move(recordId), std::move(entry));
+    return true;
+}
+
+// Applies replicated writes like local ones, held while the shards they go to
+// ask for back-pressure
+CoroResult<void> applyReplicatedWrites(std::vector<std::pair<std::string, std::string>> &writes) {
+    if (writes.empty()) {
+        co_return;
+    }
+    std::vector<bool> touched(shards.size(), false);
+    for (const auto &[recordId, entry] : writes) {
+        touched[shardIndex(recordId)] = true;
+    }
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (!touched[i])
+            continue;
+        for (auto delay = shards[i]->db.writeDelay(); delay.count() > 0; delay = shards[i]->db.writeDelay()) {
+            countEvent(Counter::write_stall_micros, delay.count());
+            co_await redka::io::SleepFor(delay);
+        }
+    }
+    writeBatchToWAL(writes);
+    countEvent(Counter::replicated_entries, writes.size());
+    writes.clear();
+}
+
+// One connection to the primary: asks for the writes after the applied
+// position and applies them in batches. Returns once the connection breaks;
+// writes received but not applied yet are asked for again
+CoroResult<void> replicateFrom(TcpSocket &socket) {
+    std::string request =
+        REPLICATE_COMMAND + std::to_string(replica.epoch) + ' ' + std::to_string(replica.seq) + '\n';
+    if (co_await socket.WriteAll(std::span(request.data(), request.size())) != request.size()) {
+        co_return;
+    }
+
+    RingBuffer input(MAX_REQUEST_SIZE);
+    std::string line;
+    std::vector<std::pair<std::string, std::string>> pending;
+    // Last write received; during a snapshot, the position it brings
+    uint64_t received = replica.seq;
+    uint64_t snapshotEpoch = 0;
+    bool inSnapshot = false;
+    while (co_await readRequest(socket, input, line) == RequestStatus::ok) {
+        bool heartbeat = false;
+        bool caughtUp = false;
+        if (line.starts_with(SNAPSHOT_HEADER)) {
+            co_await applyReplicatedWrites(pending);
+            if (!inSnapshot) {
+                replica.seq = received;
+            }
+            std::string_view position = std::string_view(line).substr(SNAPSHOT_HEADER.size());
+            if (!parseReplicationPosition(position, snapshotEpoch, received)) {
+                co_return;
+            }
+            inSnapshot = true;
+            countEvent(Counter::replica_snapshots);
+        } else if (line.starts_with("{@")) {
+            // A snapshot record
+            if (!inSnapshot || !addReplicatedWrite(pending, line)) {
+                co_return;
+            }
+        } else {
+            size_t spacePos = line.find(' ');
+            uint64_t seq = 0;
+            if (!parseUint64(std::string_view(line).substr(0, spacePos), seq)) {
+                co_return;
+            }
+            if (inSnapshot) {
+                // The snapshot is complete once the stream after it starts
+                co_await applyReplicatedWrites(pending);
+                replica.epoch = snapshotEpoch;
+                replica.seq = received;
+                inSnapshot = false;
+            }
+            heartbeat = spacePos == std::string::npos;
+            if (heartbeat) {
+                caughtUp = seq == received;
+            } else {
+                if (seq != received + 1 || !addReplicatedWrite(pending, line.substr(spacePos + 1))) {
+                    co_return;
+                }
+                received = seq;
+            }
+        }
+
+        // Like pipelined requests, applied together once the input runs dry
+        if (heartbeat || pending.size() >= REPLICA_APPLY_BATCH || input.Find('\n') == RingBuffer::npos) {
+            co_await applyReplicatedWrites(pending);
+            if (!inSnapshot) {
+                replica.seq = received;
+            }
+            if (caughtUp) {
+                replica.caughtUpAt = std::chrono::steady_clock::now();
+            }
+        }
+    }
+}
+
+// Follower mode: tails the primary for as long as the server runs,
+// reconnecting from the applied position
+CoroResult<void> followPrimary(Acceptor *acceptor, sockaddr_in primary) {
+    while (true) {
+        std::optional<TcpSocket> socket = co_await acceptor->Connect(primary);
+        if (socket) {
+            co_await replicateFrom(*socket);
+        }
+        co_await redka::io::SleepFor(REPLICA_RECONNECT_DELAY);
+    }
+}
+
+// Whether a follower has to refuse reads
+bool replicaIsStale() {
+    return replica.enabled && std::chrono::steady_clock::now() - replica.caughtUpAt > REPLICA_MAX_STALENESS;
+}
+
+// Handle the client connection
+CoroResult<void> serveJDR(TcpSocket &socket, RingBuffer &input, RingBuffer &output) {
+    std::string message;
+    // Requests answered since the responses were last sent
+    size_t inFlight = 0;
+
+    while (true) {
+        // Pipelined requests are answered together, flush once the input runs
+        // dry. A deep pipeline is answered in parts with the other connections
+        // served in between
+        if (input.Find('\n') == RingBuffer::npos || inFlight == MAX_IN_FLIGHT_REQUESTS) {
+            if (!co_await flushResponse(socket, output)) {
+                break;
+            }
+            if (inFlight == MAX_IN_FLIGHT_REQUESTS) {
+                co_await redka::io::SleepFor(Executor::Clock::duration::zero());
+            }
+            inFlight = 0;
+        }
+
+        RequestStatus status = co_await readRequest(socket, input, message);
+        if (status == RequestStatus::closed) {
+            break;
+        }
+        if (status == RequestStatus::tooLarge) {
+            co_await writeResponseCode(socket, output, RDXbad);
+            break;
+        }
+        if (message.empty()) {
+            continue;
+        }
+        ++inFlight;
+
+        bool sampled = sampleTrace();
+        // Lives across co_await, so it goes on a track of its own; storage
+        // calls below run under a TraceScope and nest their spans on the thread
+        TraceSpan requestSpan("request", sampled, nextRequestId++);
+
+        if (message.starts_with(TRACE_COMMAND)) {
+            TraceAction action;
+            uint32_t sampling = 0;
+            if (!parseTraceMessage(message, action, sampling)) {
+                co_await writeResponseCode(socket, output, RDKAbad);
+                break;
+            }
+
+            // Answered with RDKAnone. A dump is written by the trace dump
+            // thread and answered with the path it goes to, or with RDKAbusy
+            // while the last one is too recent
+            std::string response = std::to_string(RDKAnone) + '\n';
+            if (action == TraceAction::dump) {
+                std::string path;
+                response = requestTraceDump(path) ? path + '\n' : std::to_string(RDKAbusy) + '\n';
+            } else {
+                setTraceSampling(action == TraceAction::on ? sampling : 0);
+            }
+            if (!co_await writeResponse(socket, output, response)) {
+                break;
+            }
+            continue;
+        }
+
+        if (message.starts_with(REPLICATE_COMMAND)) {
+            uint64_t epoch = 0;
+            uint64_t seq = 0;
+            if (!parseReplicationPosition(std::string_view(message).substr(REPLICATE_COMMAND.size()), epoch, seq)) {
+                co_await writeResponseCode(socket, output, RDKAbad);
+                break;
+            }
+            // The connection is the follower's stream from now on
+            requestSpan.discard();
+            ++connectedReplicas;
+            co_await streamReplication(socket, output, epoch, seq);
+            --connectedReplicas;
+            break;
+        }
+
+        if (message == STATS_COMMAND || message == STATS_COMMAND + " " + PROMETHEUS_FORMAT) {
+            requestSpan.rename("stats");
+            // The Prometheus text spans lines and ends with "# EOF"
+            bool written = message == STATS_COMMAND
+                               ? co_await writeResponse(socket, output, renderStats() + '\n')
+                               : co_await writeResponse(socket, output, renderPrometheus() + "# EOF\n");
+            if (!written) {
+                break;
+            }
+            continue;
+        }
+
+        if (message.starts_with(MULTI_GET_COMMAND)) {
+            countEvent(Counter::multi_gets);
+            std::vector<std::string> recordIds;
+            bool gotUnclearID = !parseMultiGetMessage(message, recordIds);
+            try {
+                for (const auto &recordId : recordIds) {
+                    UUIDv4::UUID::fromStrFactory(recordId);
+                }
+            } catch (...) {
+                gotUnclearID = true;
+            }
+            if (gotUnclearID) {
+                co_await writeResponseCode(socket, output, RDKAbad);
+                break;
+            }
+
+            if (replicaIsStale()) {
+                if (!co_await writeResponseCode(socket, output, RDKAreplica)) {
+                    break;
+                }
+                continue;
+            }
+
+            requestSpan.rename("mget");
+            std::vector<std::shared_ptr<const MergeMap>> records;
+            {
+                TraceScope scope(sampled);
+                records = readRecordsByIds(recordIds);
+            }
+            bool written = true;
+            for (const auto &record : records) {
+                written = record ? co_await writeRecord(socket, output, *record)
+                                 : co_await writeResponseCode(socket, output, RDKAnone);
+                if (!written) {
+                    break;
+                }
+            }
+            if (!written) {
+                break;
+            }
+            continue;
+        }
+
+        if (message.starts_with(SCAN_COMMAND)) {
+            countEvent(Counter::scans);
+            ScanQuery query;
+            if (!parseScanMessage(message, query)) {
+                co_await writeResponseCode(socket, output, RDKAbad);
+                break;
+            }
+
+            if (replicaIsStale()) {
+                if (!co_await writeResponseCode(socket, output, RDKAreplica)) {
+                    break;
+                }
+                continue;
+            }
+
+            // Records come as {@id ...} lines, then the cursor for the next
+            // page or RDKAnone once the range is exhausted
+            requestSpan.rename("scan");
+            bool more = false;
+            std::vector<std::pair<std::string, MergeMap>> records;
+            {
+                TraceScope scope(sampled);
+                records = scanRecords(query, more);
+            }
+            // The page goes out in response-sized parts, not an await per record
+            bool written = true;
+            std::string part;
+            for (const auto &[recordId, record] : records) {
+                appendRecordLine(part, record, recordId);
+                if (part.size() >= RESPONSE_CHUNK_SIZE) {
+                    if (!(written = co_await writeResponse(socket, output, part))) {
+                        break;
+                    }
+                    part.clear();
+                }
+            }
+            if (!written) {
+                break;
+            }
+            if (more && !records.empty()) {
+                part += records.back().first + '\n';
+            } else {
+                part += std::to_string(RDKAnone) + '\n';
+            }
+            if (!co_await writeResponse(socket, output, part)) {
+                break;
+            }
+            continue;
+        }
+
+        if (message.starts_with(BATCH_COMMAND)) {
+            countEvent(Counter::batches);
+            size_t count = 0;
+            if (!parseBatchMessage(message, count)) {
+                co_await writeResponseCode(socket, output, RDKAbad);
+                break;
+            }
+
+            std::vector<std::string> lines(count);
+            RequestStatus status = RequestStatus::ok;
+            size_t batchBytes = 0;
+            for (size_t i = 0; i < count && status == RequestStatus::ok; ++i) {
+                status = co_await readRequest(socket, input, lines[i]);
+                batchBytes += lines[i].size();
+                if (batchBytes > MAX_BATCH_BYTES) {
+                    status = RequestStatus::tooLarge;
+                }
+            }
+            if (status == RequestStatus::closed) {
+                break;
+            }
+            if (status == RequestStatus::tooLarge) {
+                co_await writeResponseCode(socket, output, RDXbad);
+                break;
+            }
+            if (replica.enabled) {
+                if (!co_await writeResponseCode(socket, output, RDKAreplica)) {
+                    break;
+                }
+                continue;
+            }
+
+            // Nothing is written unless every record parses, versions included
+            requestSpan.rename("batch");
+            LatencyTimer timer(Histogram::batch);
+            std::vector<std::pair<std::string, std::string>> writes;
+            bool parsed = true;
+            bool gorParseError = false;
+            try {
+                TraceScope scope(sampled);
+                TraceSpan parseSpan("parse");
+                for (const auto &line : lines) {
+                    std::string objectData;
+                    bool isUpdate = false;
+                    std::string updateIndex;
+                    if (!(parsed = parseWriteMessage(line, objectData, isUpdate, updateIndex))) {
+                        break;
+                    }
+                    if (isUpdate) {
+                        writes.emplace_back(updateIndex, objectData);
+                    } else {
+                        std::string newID = uuidGenerator.getUUID().str();
+                        writes.emplace_back(newID, "{@" + newID + " " + objectData + "}");
+                    }
+                    countEvent(isUpdate ? Counter::updates : Counter::creates);
+                }
+            } catch (...) {
+                gorParseError = true;
+            }
+            if (gorParseError) {
+                co_await writeResponseCode(socket, output, RDXbad);
+                break;
+            }
+            if (!parsed) {
+                co_await writeResponseCode(socket, output, RDKAbad);
+                break;
+            }
+
+            // Held until every shard the batch writes to takes writes
+            std::vector<bool> touched(shards.size(), false);
+            for (const auto &[recordId, logEntry] : writes) {
+                touched[shardIndex(recordId)] = true;
+            }
+            WriteSlot slot = WriteSlot::granted;
+            for (size_t i = 0; i < shards.size() && slot == WriteSlot::granted; ++i) {
+                if (touched[i]) {
+                    slot = co_await waitForWriteSlot(socket, output, *shards[i]);
+                }
+            }
+            if (slot == WriteSlot::closed) {
+                break;
+            }
+            if (slot == WriteSlot::busy) {
+                if (!co_await writeResponseCode(socket, output, RDKAbusy)) {
+                    break;
+                }
+                continue;
+            }
+            {
+                TraceScope scope(sampled);
+                writeBatchToWAL(writes);
+            }
+            std::string response;
+            for (const auto &[recordId, logEntry] : writes) {
+                response += recordId;
+                response += '\n';
+            }
+            if (!co_await writeResponse(socket, output, response)) {
+                break;
+            }
+            continue;
+        }
+
+        std::string idOrRecord;
+        bool isRead = false;
+        bool isUpdate = false;
+        std::string idOfRecordToUpdate;
+
+        bool parsed = false;
+        bool gorParseError = false;
+        try {
+            TraceScope scope(sampled);
+            TraceSpan parseSpan("parse");
+            parsed = parseMessage(message, idOrRecord, isRead, isUpdate, idOfRecordToUpdate);
+        } catch (...) {
+            gorParseError = true;
+            // 'co_await' cannot be used in the handler of a try block
+        }
+        if (gorParseError) {
+            co_await writeResponseCode(socket, output, RDXbad);
+            break;
+        }
+        if (!parsed) {
+            co_await writeResponseCode(socket, output, RDKAbad);
+            break;
+        }
+
+        // Read query
+        if (isRead) {
+            std::string recordId;
+            FieldProjection projection;
+            // Check if is correct UUID by trying to parse it
+            bool gotUnclearID = false;
+            try {
+                gotUnclearID = !parseReadQuery(idOrRecord, recordId, projection);
+                UUIDv4::UUID::fromStrFactory(recordId);
+            } catch (...) {
+                gotUnclearID = true;
+            }
+            if (gotUnclearID) {
+                co_await writeResponseCode(socket, output, RDKAbad);
+                break;
+            }
+
+            if (replicaIsStale()) {
+                if (!co_await writeResponseCode(socket, output, RDKAreplica)) {
+                    break;
+                }
+                continue;
+            }
+
+            requestSpan.rename("read");
+            LatencyTimer timer(Histogram::read);
+            countEvent(Counter::reads);
+            std::shared_ptr<const MergeMap> requestedRecord;
+            {
+                TraceScope scope(sampled);
+                requestedRecord = readRecordById(recordId, projection);
+            }
+            if (!requestedRecord) {
+                countEvent(Counter::read_misses);
+            }
+            bool written = requestedRecord ? co_await writeRecord(socket, output, *requestedRecord)
+                                           : co_await writeResponseCode(socket, output, RDKAnone);
+            if (!written) {
+                break;
+            }
+            continue;
+        }
+
+        if (replica.enabled) {
+            if (!co_await writeResponseCode(socket, output, RDKAreplica)) {
+                break;
+            }
+            continue;
+        }
+
+        requestSpan.rename(isUpdate ? "update" : "create");
+        std::string writtenID = idOfRecordToUpdate;
+        WriteSlot slot = co_await writeSingleRecord(socket, output, isUpdate, idOrRecord, writtenID, sampled);
+        if (slot == WriteSlot::closed) {
+            break;
+        }
+        if (slot == WriteSlot::busy) {
+            if (!co_await writeResponseCode(socket, output, RDKAbusy)) {
+                break;
+            }
+            continue;
+        }
+        if (!co_await writeResponse(socket, output, writtenID + '\n')) {
+            break;
+        }
+    }
+}
+
+enum class RdxParse {
+    ok,
+    // Well-formed but not a valid request: RDKAbad
+    bad,
+    // Lengths past the end of the frame: RDXbad
+    malformed,
+};
+
+// "{field@version:value ...}" from the fields of a binary write
+RdxParse parseRdxRecord(std::string_view payload, std::string &record) {
+    record = "{";
+    while (!payload.empty()) {
+        RdxField field;
+        if (!readRdxField(payload, field))
+            return RdxParse::malformed;
+        FieldId id = 0;
+        if (!isRdxFieldName(field.name) || !isRdxFieldValue(field.value) || !tryInternField(field.name, id))
+            return RdxParse::bad;
+        if (record.size() > 1) {
+            record += ' ';
+        }
+        appendFieldToRecord(record, field.name, field.version, field.value);
+    }
+    if (record.size() == 1)
+        return RdxParse::bad;
+    record += '}';
+    return RdxParse::ok;
+}
+
+// Field names a binary read is restricted to, none for the whole record.
+// Names never written are in no record and are dropped, as over JDR
+RdxParse parseRdxProjection(std::string_view payload, FieldProjection &projection) {
+    if (payload.empty())
+        return RdxParse::ok;
+    std::vector<FieldId> fields;
+    while (!payload.empty()) {
+        std::string_view name;
+        if (!readRdxBytes(payload, name))
+            return RdxParse::malformed;
+        if (!isRdxFieldName(name))
+            return RdxParse::bad;
+        FieldId field = 0;
+        if (findField(name, field)) {
+            fields.push_back(field);
+        }
+    }
+    projection = FieldProjection(std::move(fields));
+    return RdxParse::ok;
+}
+
+CoroResult<bool> writeRdxCode(TcpSocket &socket, RingBuffer &output, int code) {
+    std::string frame;
+    appendFrameHeader(frame, code, 0);
+    co_return co_await writeResponse(socket, output, frame);
+}
+
+CoroResult<bool> writeRdxId(TcpSocket &socket, RingBuffer &output, const std::string &recordId) {
+    RecordKey key;
+    parseRecordKey(recordId, key);
+    std::string frame;
+    appendFrameHeader(frame, RDX_ID_FRAME, RDX_ID_SIZE);
+    appendRdxId(frame, key);
+    co_return co_await writeResponse(socket, output, frame);
+}
+
+// Streams the record field by field like writeRecord, the length goes first
+CoroResult<bool> writeRdxRecord(TcpSocket &socket, RingBuffer &output, const MergeMap &record) {
+    size_t length = 0;
+    for (const auto &[field, versionedValue] : record) {
+        length += rdxFieldSize(fieldName(field), versionedValue.second);
+    }
+    std::string part;
+    appendFrameHeader(part, RDX_RECORD_FRAME, length);
+    for (auto it : fieldsByName(record)) {
+        appendRdxField(part, fieldName(it->first), it->second.first, it->second.second);
+        if (!co_await writeResponse(socket, output, part)) {
+            co_return false;
+        }
+        part.clear();
+    }
+    co_return part.empty() || co_await writeResponse(socket, output, part);
+}
+
+// Binary RDX requests, see rdx_binary.h. Errors, staleness and back-pressure
+// are answered as over JDR, with the codes as frames
+CoroResult<void> serveRdxBinary(TcpSocket &socket, RingBuffer &input, RingBuffer &output) {
+    countEvent(Counter::rdx_connections);
+    RdxFrameHeader header;
+    std::string payload;
+    size_t inFlight = 0;
+
+    while (true) {
+        if (!hasRdxFrame(input) || inFlight == MAX_IN_FLIGHT_REQUESTS) {
+            if (!co_await flushResponse(socket, output)) {
+                break;
+            }
+            if (inFlight == MAX_IN_FLIGHT_REQUESTS) {
+                co_await redka::io::SleepFor(Executor::Clock::duration::zero());
+            }
+            inFlight = 0;
+        }
+
+        RequestStatus status = co_await readRdxFrame(socket, input, header, payload);
+        if (status == RequestStatus::closed) {
+            break;
+        }
+        if (status == RequestStatus::tooLarge) {
+            co_await writeRdxCode(socket, output, RDXbad);
+            break;
+        }
+        ++inFlight;
+
+        bool sampled = sampleTrace();
+        TraceSpan requestSpan("request", sampled, nextRequestId++);
+        std::string_view in = payload;
+        auto op = static_cast<RdxOp>(header.type);
+
+        if (op == RdxOp::get) {
+            RecordKey key;
+            FieldProjection projection;
+            RdxParse parse = RdxParse::malformed;
+            try {
+                if (readRdxId(in, key)) {
+                    parse = parseRdxProjection(in, projection);
+                }
+            } catch (...) {
+                parse = RdxParse::malformed;
+            }
+            if (parse != RdxParse::ok) {
+                co_await writeRdxCode(socket, output, parse == RdxParse::bad ? RDKAbad : RDXbad);
+                break;
+            }
+
+            if (replicaIsStale()) {
+                if (!co_await writeRdxCode(socket, output, RDKAreplica)) {
+                    break;
+                }
+                continue;
+            }
+
+            requestSpan.rename("read");
+            LatencyTimer timer(Histogram::read);
+            countEvent(Counter::reads);
+            std::shared_ptr<const MergeMap> requestedRecord;
+            {
+                TraceScope scope(sampled);
+                requestedRecord = readRecordById(formatRecordKey(key), projection);
+            }
+            if (!requestedRecord) {
+                countEvent(Counter::read_misses);
+            }
+            bool written = requestedRecord ? co_await writeRdxRecord(socket, output, *requestedRecord)
+                                           : co_await writeRdxCode(socket, output, RDKAnone);
+            if (!written) {
+                break;
+            }
+            continue;
+        }
+
+        if (op == RdxOp::multiGet) {
+            countEvent(Counter::multi_gets);
+            if (in.empty() || in.size() % RDX_ID_SIZE != 0) {
+                co_await writeRdxCode(socket, output, RDXbad);
+                break;
+            }
+            std::vector<std::string> recordIds;
+            RecordKey key;
+            while (readRdxId(in, key)) {
+                recordIds.push_back(formatRecordKey(key));
+            }
+
+            if (replicaIsStale()) {
+                if (!co_await writeRdxCode(socket, output, RDKAreplica)) {
+                    break;
+                }
+                continue;
+            }
+
+            requestSpan.rename("mget");
+            std::vector<std::shared_ptr<const MergeMap>> records;
+            {
+                TraceScope scope(sampled);
+                records = readRecordsByIds(recordIds);
+            }
+            bool written = true;
+            for (const auto &record : records) {
+                written = record ? co_await writeRdxRecord(socket, output, *record)
+                                 : co_await writeRdxCode(socket, output, RDKAnone);
+                if (!written) {
+                    break;
+                }
+            }
+            if (!written) {
+                break;
+            }
+            continue;
+        }
+
+        if (op != RdxOp::create && op != RdxOp::update) {
+            co_await writeRdxCode(socket, output, RDKAbad);
+            break;
+        }
+
+        bool isUpdate = op == RdxOp::update;
+        RecordKey key;
+        std::string record;
+        RdxParse parse = isUpdate && !readRdxId(in, key) ? RdxParse::malformed : parseRdxRecord(in, record);
+        if (parse != RdxParse::ok) {
+            co_await writeRdxCode(socket, output, parse == RdxParse::bad ? RDKAbad : RDXbad);
+            break;
+        }
+
+        if (replica.enabled) {
+            if (!co_await writeRdxCode(socket, output, RDKAreplica)) {
+                break;
+            }
+            continue;
+        }
+
+        requestSpan.rename(isUpdate ? "update" : "create");
+        std::string writtenID;
+        if (isUpdate) {
+            writtenID = formatRecordKey(key);
+            record = "{@" + writtenID + " " + record + "}";
+        }
+        WriteSlot slot = co_await writeSingleRecord(socket, output, isUpdate, record, writtenID, sampled);
+        if (slot == WriteSlot::closed) {
+            break;
+        }
+        if (slot == WriteSlot::busy) {
+            if (!co_await writeRdxCode(socket, output, RDKAbusy)) {
+                break;
+            }
+            continue;
+        }
+        if (!co_await writeRdxId(socket, output, writtenID)) {
+            break;
+        }
+    }
+}
+
+CoroResult<void> handleClient(TcpSocket socket) {
+    RingBuffer input(MAX_REQUEST_SIZE);
+    RingBuffer output(MAX_RESPONSE_BUFFER);
+    countEvent(Counter::connections);
+
+    // The first byte picks the protocol for the whole connection
+    if (co_await fillInput(socket, input, 1)) {
+        if (input.ReadableSpan()[0] == RDX_BINARY_MAGIC) {
+            input.Consume(1);
+            co_await serveRdxBinary(socket, input, output);
+        } else {
+            co_await serveJDR(socket, input, output);
+        }
+    }
+
+    co_await flushResponse(socket, output);
+    --openConnections;
+}
+
+void registerServerGauges(const Executor *executor) {
+    registerGaugeSource([executor](std::vector<GaugeSample> &samples) {
+        // Summed over the shards; with more than one, their sizes show the balance
+        std::vector<LSMTree::LevelStats> levels;
+        size_t memtableRecords = 0;
+        size_t memtableBytes = 0;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            const Shard &shard = *shards[i];
+            uint64_t shardBytes = shard.wal_log.size();
+            std::vector<LSMTree::LevelStats> shardLevels = shard.db.levelStats();
+            levels.resize(std::max(levels.size(), shardLevels.size()));
+            for (size_t level = 0; level < shardLevels.size(); ++level) {
+                levels[level].files += shardLevels[level].files;
+                levels[level].bytes += shardLevels[level].bytes;
+                shardBytes += shardLevels[level].bytes;
+            }
+            // The WAL and its index are the memtable
+            memtableRecords += shard.recordIdToOffset.size();
+            memtableBytes += shard.wal_log.size();
+            if (shards.size() > 1) {
+                samples.push_back({"shard_bytes", "shard", std::to_string(i), static_cast<double>(shardBytes)});
+            }
+        }
+        for (size_t level = 0; level < levels.size(); ++level) {
+            samples.push_back({"level_files", "level", std::to_string(level), static_cast<double>(levels[level].files)});
+            samples.push_back({"level_bytes", "level", std::to_string(level), static_cast<double>(levels[level].bytes)});
+        }
+        samples.push_back({"memtable_records", "", "", static_cast<double>(memtableRecords)});
+        samples.push_back({"memtable_bytes", "", "", static_cast<double>(memtableBytes)});
+        samples.push_back({"object_cache_records", "", "", static_cast<double>(objectCache.size())});
+        samples.push_back({"object_cache_bytes", "", "", static_cast<double>(objectCache.bytes())});
+        samples.push_back({"executor_run_queue", "", "", static_cast<double>(executor->RunQueueSize())});
+        samples.push_back({"executor_timers", "", "", static_cast<double>(executor->TimerCount())});
+        // The pool of this thread, the one that runs the connections' coroutines
+        redka::io::detail::FramePoolStats frames = redka::io::detail::FramePool::Stats();
+        samples.push_back({"frame_pool_allocated", "", "", static_cast<double>(frames.allocated)});
+        samples.push_back({"frame_pool_reused", "", "", static_cast<double>(frames.reused)});
+        samples.push_back({"frame_pool_oversized", "", "", static_cast<double>(frames.oversized)});
+        samples.push_back({"frame_pool_cached", "", "", static_cast<double>(frames.cached)});
+        samples.push_back({"open_connections", "", "", static_cast<double>(openConnections)});
+        samples.push_back({"stalled_writes", "", "", static_cast<double>(stalledWrites)});
+        samples.push_back({"replication_seq", "", "", static_cast<double>(replicationLog.lastSeq())});
+        samples.push_back({"replicas", "", "", static_cast<double>(connectedReplicas)});
+        if (replica.enabled) {
+            auto staleness = std::chrono::steady_clock::now() - replica.caughtUpAt;
+            samples.push_back({"replica_staleness_ms", "", "",
+                               std::chrono::duration<double, std::milli>(staleness).count()});
+        }
+    });
+}
+
+struct ServerOptions {
+    size_t shards = 1;
+    uint16_t port = 8080;
+    // Unset, the default is lowered to what the descriptor limit allows
+    std::optional<size_t> maxConnections;
+    int backlog = SOMAXCONN;
+    Executor::Clock::duration idleTimeout = DEFAULT_IDLE_TIMEOUT;
+    // Follower mode
+    std::optional<sockaddr_in> primary;
+};
+
+// Set up the server and listen for client connections
+void startServer(const ServerOptions &options) {
+    using redka::io::Acceptor;
+    using redka::io::Executor;
+
+    struct sockaddr_in serverAddr, clientAddr;
+    socklen_t addrLen = sizeof(clientAddr);
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = INADDR_ANY;
+    serverAddr.sin_port = htons(options.port);
+
+    auto acceptor = Acceptor::ListenOn(serverAddr, options.backlog);
+
+    Executor executor(acceptor.get());
+    registerServerGauges(&executor);
+    setTraceThreadName("requests");
+    installTraceDumpSignal(SIGUSR2);
+
+    auto acceptTask = [](Executor *executor, Acceptor *acceptor, uint16_t port) -> redka::io::CoroResult<void> {
+        std::cout << "Server listening on port " << port << std::endl;
+        for (;;) {
+            std::optional<TcpSocket> socket = co_await acceptor->Accept();
+            if (!socket) {
+                countEvent(Counter::accept_pauses);
+                co_await redka::io::SleepFor(ACCEPT_RETRY_DELAY);
+                continue;
+            }
+            // Answered right here, so a burst over the cap does not pile up descriptors
+            if (openConnections >= connectionCap()) {
+                co_await rejectClient(std::move(*socket));
+                continue;
+            }
+            // Counted here, a burst of accepts runs before the handlers do
+            ++openConnections;
+            executor->Schedule(handleClient(std::move(*socket)).fire_and_forgive());
+        }
+        co_return;
+    }(&executor, acceptor.get(), options.port);
+
+    executor.Schedule(&acceptTask);
+    executor.Schedule(flushIdleWALs().fire_and_forgive());
+    if (options.primary) {
+        executor.Schedule(followPrimary(acceptor.get(), *options.primary).fire_and_forgive());
+    }
+    executor.Run();
+}
+
+bool parsePort(std::string_view value, uint16_t &port) {
+    uint64_t number = 0;
+    if (!parseUint64(value, number) || number == 0 || number > 65535)
+        return false;
+    port = number;
+    return true;
+}
+
+// "<ipv4>:<port>"
+bool parseAddress(const std::string &value, sockaddr_in &addr) {
+    size_t colon = value.rfind(':');
+    if (colon == std::string::npos)
+        return false;
+    uint16_t port = 0;
+    if (!parsePort(std::string_view(value).substr(colon + 1), port))
+        return false;
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    return inet_pton(AF_INET, value.substr(0, colon).c_str(), &addr.sin_addr) == 1;
+}
+
+// "--shards <P>" partitions the keyspace, the default 1 keeps a single tree;
+// "--replica-of <ip>:<port>" runs a read-only follower of that primary;
+// "--max-connections <N>" caps the clients served at once;
+// "--backlog <N>" is the listen backlog, SOMAXCONN by default;
+// "--idle-timeout <seconds>" disconnects idle clients, 0 never does
+bool parseOptions(int argc, char **argv, ServerOptions &options) {
+    if (argc % 2 == 0)
+        return false;
+    for (int i = 1; i < argc; i += 2) {
+        std::string arg = argv[i];
+        std::string value = argv[i + 1];
+        if (arg == "--shards") {
+            uint64_t shards = 0;
+            if (!parseUint64(value, shards) || shards == 0 || shards > MAX_SHARDS)
+                return false;
+            options.shards = shards;
+        } else if (arg == "--port") {
+            if (!parsePort(value, options.port))
+                return false;
+        } else if (arg == "--max-connections") {
+            uint64_t connections = 0;
+            if (!parseUint64(value, connections) || connections == 0 || connections > MAX_FD_LIMIT)
+                return false;
+            options.maxConnections = connections;
+        } else if (arg == "--backlog") {
+            uint64_t backlog = 0;
+            if (!parseUint64(value, backlog) || backlog == 0 || backlog > 65535)
+                return false;
+            options.backlog = backlog;
+        } else if (arg == "--idle-timeout") {
+            uint64_t seconds = 0;
+            if (!parseUint64(value, seconds) || seconds > 365 * 24 * 3600)
+                return false;
+            options.idleTimeout = std::chrono::seconds(seconds);
+        } else if (arg == "--replica-of") {
+            sockaddr_in primary;
+            if (!parseAddress(value, primary))
+                return false;
+            options.primary = primary;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    ServerOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--shards N] [--port <port>] [--replica-of <ip>:<port>] [--max-connections N]"
+                     " [--backlog N] [--idle-timeout <seconds>]"
+                  << std::endl;
+        return 2;
+    }
+    if (!checkShardCount(options.shards)) {
+        std::cerr << DB_DIR << " was created with another shard count" << std::endl;
+        return 1;
+    }
+    openShards(options.shards);
+
+    fdLimit = raiseFdLimit();
+    size_t used = RESERVED_FDS + storageFds();
+    size_t fit = used < fdLimit ? fdLimit - used : 0;
+    if (fit == 0 || (options.maxConnections && *options.maxConnections > fit)) {
+        std::cerr << "The descriptor limit of " << fdLimit << " leaves room for " << fit << " connections with "
+                  << options.shards << " shards" << std::endl;
+        return 1;
+    }
+    maxConnections = options.maxConnections.value_or(std::min(DEFAULT_MAX_CONNECTIONS, fit));
+    replica.enabled = options.primary.has_value();
+    idleTimeout = options.idleTimeout;
+    startServer(options);
     return 0;
 }
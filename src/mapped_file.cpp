@@ -1,5 +1,7 @@
 #include "mapped_file.h"
+#include "metrics.h"
 
+#include <algorithm>
 #include <cstring>
 #include <cstdio>
 
@@ -21,7 +23,8 @@ MappedFile::~MappedFile() {
     }
 }
 
-bool MappedFile::open(const std::string &path, bool write) {
+bool MappedFile::open(const std::string &path, bool write, AccessPattern pattern) {
+    pattern_ = pattern;
     fd_ = ::open(path.c_str(), write ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
     if (fd_ == -1)
         return false;
@@ -56,9 +59,30 @@ bool MappedFile::open(const std::string &path, bool write) {
         return false;
     }
 
+    advise();
     return true;
 }
 
+void MappedFile::advise() {
+    if (!mapped_data_ || pattern_ == AccessPattern::normal)
+        return;
+    // Only a hint, a failure changes nothing but performance
+    madvise(mapped_data_, file_size_, pattern_ == AccessPattern::random ? MADV_RANDOM : MADV_SEQUENTIAL);
+}
+
+void MappedFile::dropPages(size_t offset, size_t length) const {
+    if (!mapped_data_)
+        return;
+    // Rounded inwards at the end: the page there still holds unread data
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = offset / page * page;
+    size_t end = std::min(offset + length, file_size_) / page * page;
+    if (begin >= end)
+        return;
+    madvise(mapped_data_ + begin, end - begin, MADV_DONTNEED);
+    posix_fadvise(fd_, begin, end - begin, POSIX_FADV_DONTNEED);
+}
+
 char *MappedFile::data() const {
     return mapped_data_;
 }
@@ -79,13 +103,17 @@ bool MappedFile::resize(size_t new_size) {
     }
 
     file_size_ = new_size;
+    advise();
     return true;
 }
 
 void MappedFile::append(const std::string &logEntry) {
-    if (records_size_ >= file_size_) {
-        perror("WAL log is too big");
-        return;
+    if (records_size_ + logEntry.size() > file_size_) {
+        // Grow the mapping geometrically so large records fit
+        if (!resize(std::max(file_size_ * 2, records_size_ + logEntry.size()))) {
+            perror("WAL log resize failed");
+            return;
+        }
     }
 
     // Append the log entry at the old file end
@@ -93,6 +121,7 @@ void MappedFile::append(const std::string &logEntry) {
     records_size_ += logEntry.size();
 
     // Flush changes to disk
+    LatencyTimer timer(Histogram::wal_sync);
     if (msync(mapped_data_, file_size_, MS_SYNC) == -1) {
         perror("msync");
     }
@@ -129,4 +158,5 @@ void MappedFile::truncate() {
         fd_ = -1;
         throw std::system_error(errno, std::system_category(), "mmap failed after truncate");
     }
+    advise();
 }
\ No newline at end of file
@@ -9,6 +9,15 @@
 #include <string>
 #include <system_error>
 
+// How a mapping is going to be read, passed to the kernel as a hint
+enum class AccessPattern {
+    normal,
+    // Point lookups: no readahead around the faulting page
+    random,
+    // Front-to-back scans: aggressive readahead, pages behind the reader can be dropped
+    sequential,
+};
+
 // Класс для работы с memory-mapped файлами
 class MappedFile {
 private:
@@ -16,16 +25,24 @@ private:
     char *mapped_data_ = nullptr;
     size_t file_size_ = 0;
     size_t records_size_ = 0;
+    AccessPattern pattern_ = AccessPattern::normal;
+
+    // Applies pattern_ to the current mapping
+    void advise();
 
 public:
     MappedFile() = default;
     MappedFile(const std::string &);
     ~MappedFile();
 
-    bool open(const std::string &path, bool write = false);
+    bool open(const std::string &path, bool write = false, AccessPattern pattern = AccessPattern::normal);
     char *data() const;
     size_t size() const;
     bool resize(size_t new_size);
     void append(const std::string &);
     void truncate();
+    // Releases the whole pages of [offset, offset + length) from the mapping
+    // and the page cache, for data a scan has consumed. Pages other mappings
+    // still have mapped stay cached
+    void dropPages(size_t offset, size_t length) const;
 };
\ No newline at end of file
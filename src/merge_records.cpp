@@ -1,82 +1,138 @@
+#include "merge_records.h"
+
+#include <algorithm>
+#include <charconv>
 #include <iostream>
 #include <map>
-#include <regex>
-#include <sstream>
 #include <string>
+#include <string_view>
 
-auto parseRecordToMap(const std::string& str) {
-    std::regex re(R"(\{([^}]+)\})");
-    std::smatch match;
-
-    std::map<std::string, std::string> result;
-    if (regex_search(str, match, re)) {
-        std::string recordContent = match[1].str();
-        std::stringstream ss(recordContent);
-        std::string keyValue;
-        while (getline(ss, keyValue, ' ')) {
-            size_t pos = keyValue.find(':');
-            if (pos != std::string::npos) {
-                std::string key = keyValue.substr(0, pos);
-                key.erase(std::remove(key.begin(), key.end(), '{'), key.end());
-                std::string value = keyValue.substr(pos + 1);
-                result[key] = value;
-            }
+// Content of the first non-empty {...} group. Scanned by hand: std::regex
+// recurses per character and overflows the stack on large values
+std::string_view findRecordContent(std::string_view str) {
+    size_t open = str.find('{');
+    while (open != std::string_view::npos) {
+        size_t close = str.find('}', open + 1);
+        if (close == std::string_view::npos) {
+            break;
         }
+        if (close > open + 1) {
+            return str.substr(open + 1, close - open - 1);
+        }
+        open = str.find('{', open + 1);
     }
-    return result;
+    return {};
 }
 
-std::string convertMapToRecord(const std::map<std::string, std::pair<uint32_t, std::string>>& map) {
-    std::stringstream result;
-    result << "{";
-    bool first = true;
-    for (const auto& kv : map) {
-        if (!first) {
-            result << " ";
-        }
-        first = false;
-        // Omitting version for economy and readability
-        if (kv.second.first == 1) {
-            result << kv.first << ":" << kv.second.second;
-        } else {
-            result << kv.first << "@" << kv.second.first << ":" << kv.second.second;
+bool parseFieldVersion(std::string_view text, uint32_t& version) {
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), version);
+    return !text.empty() && error == std::errc() && end == text.data() + text.size();
+}
+
+// Calls `apply(key, value)` for every `key:value` of `record`, the key being
+// `field[@version]` with any braces dropped
+template <typename Apply>
+void forEachRecordField(std::string_view record, Apply&& apply) {
+    std::string_view recordContent = findRecordContent(record);
+    while (!recordContent.empty()) {
+        size_t spacePos = recordContent.find(' ');
+        std::string_view keyValue = recordContent.substr(0, spacePos);
+        recordContent = spacePos == std::string_view::npos ? std::string_view{} : recordContent.substr(spacePos + 1);
+
+        size_t pos = keyValue.find(':');
+        if (pos == std::string_view::npos)
+            continue;
+
+        std::string_view key = keyValue.substr(0, pos);
+        std::string_view value = keyValue.substr(pos + 1);
+        std::string unbraced;
+        if (key.find('{') != std::string_view::npos) {
+            unbraced = std::string(key);
+            unbraced.erase(std::remove(unbraced.begin(), unbraced.end(), '{'), unbraced.end());
+            key = unbraced;
         }
+        apply(key, value);
     }
-    result << "}";
-    return result.str();
 }
 
-void addToMergeMap(std::map<std::string, std::pair<uint32_t, std::string>>& mergeMap,
-                   const std::map<std::string, std::string>& map) {
-    for (const auto& kv : map) {
+bool checkRecordFields(std::string_view record) {
+    bool valid = true;
+    forEachRecordField(record, [&valid](std::string_view key, std::string_view) {
+        size_t versionPos = key.find('@');
+        uint32_t version = 0;
+        FieldId field = 0;
+        if (versionPos != std::string_view::npos && !parseFieldVersion(key.substr(versionPos + 1), version)) {
+            valid = false;
+        } else if (valid && !tryInternField(key.substr(0, versionPos), field)) {
+            valid = false;
+        }
+    });
+    return valid;
+}
+
+// Applies every `field[@version]:value` of `record` in `projection` to
+// `mergeMap`. A field replaces the mapped one if its version is higher, or
+// equal and `newerWins`
+void addRecordToMergeMap(MergeMap& mergeMap, std::string_view record, bool newerWins,
+                         const FieldProjection& projection = {}) {
+    forEachRecordField(record, [&](std::string_view key, std::string_view value) {
+        size_t versionPos = key.find('@');
+        FieldId field = internField(key.substr(0, versionPos));
+        if (!projection.contains(field))
+            return;
+
+        // Writes are checked before they are applied, a bad version can
+        // only come from data written before that
         uint32_t version = 1;
-        std::string key = kv.first;
-        size_t pos = key.find('@');
-        if (pos != std::string::npos) {
-            key = kv.first.substr(0, pos);
-            version = static_cast<uint32_t>(std::stoul(kv.first.substr(pos + 1)));
+        if (versionPos != std::string_view::npos && !parseFieldVersion(key.substr(versionPos + 1), version))
+            return;
+
+        auto [it, inserted] = mergeMap.try_emplace(field, version, value);
+        if (!inserted && (it->second.first < version || (newerWins && it->second.first == version))) {
+            it->second = {version, std::string(value)};
         }
+    });
+}
+
+void appendFieldToRecord(std::string& out, std::string_view field, uint32_t version, std::string_view value) {
+    out += field;
+    // Omitting version for economy and readability
+    if (version != 1) {
+        out += '@';
+        out += std::to_string(version);
+    }
+    out += ':';
+    out += value;
+}
 
-        if (mergeMap.find(key) != mergeMap.end()) {
-            uint32_t previousVersion = mergeMap[key].first;
-            if (previousVersion >= version)
-                continue;
+std::string convertMapToRecord(const MergeMap& map) {
+    std::string result = "{";
+    bool first = true;
+    for (auto it : fieldsByName(map)) {
+        if (!first) {
+            result += ' ';
         }
-        mergeMap[key] = std::make_pair(version, kv.second);
+        first = false;
+        appendFieldToRecord(result, fieldName(it->first), it->second.first, it->second.second);
     }
+    result += '}';
+    return result;
 }
 
-auto mergeTwoMaps(std::map<std::string, std::string>& firstMap, std::map<std::string, std::string>& secondMap) {
-    // Format: key - (version, value)
-    std::map<std::string, std::pair<uint32_t, std::string>> mergeMap;
-    addToMergeMap(mergeMap, firstMap);
-    addToMergeMap(mergeMap, secondMap);
+MergeMap mergeTwoRecordsToMap(const std::string& firstRecord, const std::string& secondRecord,
+                              const FieldProjection& projection) {
+    // The first record wins on equal versions
+    MergeMap mergeMap;
+    addRecordToMergeMap(mergeMap, firstRecord, false, projection);
+    addRecordToMergeMap(mergeMap, secondRecord, false, projection);
     return mergeMap;
 }
 
-std::string mergeTwoRecords(const std::string& firstRecord, const std::string& secondRecord) {
-    std::map<std::string, std::string> firstMap = parseRecordToMap(firstRecord);
-    std::map<std::string, std::string> secondMap = parseRecordToMap(secondRecord);
-    auto mergeMap = mergeTwoMaps(firstMap, secondMap);
-    return convertMapToRecord(mergeMap);
+std::string mergeTwoRecords(const std::string& firstRecord, const std::string& secondRecord,
+                            const FieldProjection& projection) {
+    return convertMapToRecord(mergeTwoRecordsToMap(firstRecord, secondRecord, projection));
+}
+
+void mergeNewerRecordIntoMap(MergeMap& target, const std::string& newerRecord) {
+    addRecordToMergeMap(target, newerRecord, true);
 }
@@ -1,4 +1,29 @@
-#include <string>
+#pragma once
+
+#include <cstdint>
 #include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "field_symbols.h"
+
+// Format: interned field name -> (version, value)
+using MergeMap = std::map<FieldId, std::pair<uint32_t, std::string>>;
 
-std::string mergeTwoRecords(const std::string& firstRecord, const std::string& secondRecord);
+// Fields outside `projection` are skipped without parsing their versions or copying their values
+std::string mergeTwoRecords(const std::string& firstRecord, const std::string& secondRecord,
+                            const FieldProjection& projection = {});
+MergeMap mergeTwoRecordsToMap(const std::string& firstRecord, const std::string& secondRecord,
+                              const FieldProjection& projection = {});
+// Appends `field[@version]:value` in the same form convertMapToRecord uses
+void appendFieldToRecord(std::string& out, std::string_view field, uint32_t version, std::string_view value);
+// `text` is what follows the '@' of a field; false unless it is a decimal
+// number that fits 32 bits
+bool parseFieldVersion(std::string_view text, uint32_t& version);
+// Whether every field of a record has no version or one parseFieldVersion
+// takes, and a name the field table has or takes in. Writes are checked with
+// it before anything is applied
+bool checkRecordFields(std::string_view record);
+// Applies the fields of a newer record on top of `target`; newer wins on equal versions
+void mergeNewerRecordIntoMap(MergeMap& target, const std::string& newerRecord);
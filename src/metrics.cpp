@@ -0,0 +1,301 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <iterator>
+#include <mutex>
+
+namespace {
+const size_t COUNTERS = static_cast<size_t>(Counter::COUNT);
+const size_t HISTOGRAMS = static_cast<size_t>(Histogram::COUNT);
+
+const char *const COUNTER_NAMES[] = {
+    "reads", "read_misses", "multi_gets", "scans", "creates", "updates", "batches", "wal_bytes", "write_stalls",
+    "write_stall_micros", "flushes", "flushed_bytes", "compactions", "compacted_bytes", "connections",
+    "replicated_entries", "replica_snapshots", "busy_rejections", "accept_pauses", "busy_connections",
+    "idle_disconnects", "wal_idle_flushes", "rdx_connections",
+};
+const char *const HISTOGRAM_NAMES[] = {"read", "create", "update", "batch", "wal_append", "wal_sync", "flush",
+                                       "compaction"};
+static_assert(std::size(COUNTER_NAMES) == COUNTERS);
+static_assert(std::size(HISTOGRAM_NAMES) == HISTOGRAMS);
+
+const std::pair<double, const char *> QUANTILES[] = {{0.5, "p50"}, {0.9, "p90"}, {0.99, "p99"}, {0.999, "p999"}};
+
+// Values below 2 * SUB_BUCKETS have a bucket each; every further power of
+// two is split into SUB_BUCKETS equal buckets
+const size_t SUB_BUCKET_BITS = 4;
+const size_t SUB_BUCKETS = size_t{1} << SUB_BUCKET_BITS;
+const size_t BUCKETS = (65 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+size_t bucketOf(uint64_t value) {
+    if (value < 2 * SUB_BUCKETS)
+        return value;
+    size_t shift = std::bit_width(value) - SUB_BUCKET_BITS - 1;
+    return (shift + 1) * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS;
+}
+
+// Largest value that falls into the bucket
+uint64_t bucketHighest(size_t bucket) {
+    if (bucket < 2 * SUB_BUCKETS)
+        return bucket;
+    size_t shift = bucket / SUB_BUCKETS - 1;
+    uint64_t lowest = static_cast<uint64_t>(bucket % SUB_BUCKETS + SUB_BUCKETS) << shift;
+    return lowest + ((uint64_t{1} << shift) - 1);
+}
+
+struct LatencyCells {
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+};
+
+struct Shard {
+    std::array<std::atomic<uint64_t>, COUNTERS> counters{};
+    std::array<LatencyCells, HISTOGRAMS> latencies{};
+};
+
+// A shard has a single writer, so a read-modify-write needs no lock prefix;
+// the atomics only keep concurrent readers well-defined
+void add(std::atomic<uint64_t> &cell, uint64_t delta) {
+    cell.store(cell.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+void raise(std::atomic<uint64_t> &cell, uint64_t value) {
+    if (value > cell.load(std::memory_order_relaxed)) {
+        cell.store(value, std::memory_order_relaxed);
+    }
+}
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<Shard *> live;
+    // Totals of the threads that have exited
+    Shard retired;
+    std::vector<GaugeSource> gauge_sources;
+};
+
+// Never destroyed: the compaction thread may exit during static destruction
+Registry &registry() {
+    static Registry *instance = new Registry;
+    return *instance;
+}
+
+class ShardOwner {
+private:
+    Shard *shard = new Shard;
+
+public:
+    ShardOwner() {
+        Registry &r = registry();
+        std::lock_guard lock(r.mutex);
+        r.live.push_back(shard);
+    }
+    ~ShardOwner() {
+        Registry &r = registry();
+        std::lock_guard lock(r.mutex);
+        for (size_t i = 0; i < COUNTERS; ++i) {
+            add(r.retired.counters[i], shard->counters[i].load(std::memory_order_relaxed));
+        }
+        for (size_t h = 0; h < HISTOGRAMS; ++h) {
+            LatencyCells &from = shard->latencies[h];
+            LatencyCells &to = r.retired.latencies[h];
+            for (size_t b = 0; b < BUCKETS; ++b) {
+                add(to.buckets[b], from.buckets[b].load(std::memory_order_relaxed));
+            }
+            add(to.count, from.count.load(std::memory_order_relaxed));
+            add(to.sum, from.sum.load(std::memory_order_relaxed));
+            raise(to.max, from.max.load(std::memory_order_relaxed));
+        }
+        r.live.erase(std::find(r.live.begin(), r.live.end(), shard));
+        delete shard;
+    }
+    ShardOwner(const ShardOwner &) = delete;
+    ShardOwner &operator=(const ShardOwner &) = delete;
+
+    Shard &get() {
+        return *shard;
+    }
+};
+
+Shard &localShard() {
+    thread_local ShardOwner owner;
+    return owner.get();
+}
+
+struct LatencySnapshot {
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(BUCKETS);
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    // Nanoseconds; the highest value of the bucket holding the quantile
+    uint64_t quantile(double q) const {
+        if (count == 0)
+            return 0;
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * count)));
+        uint64_t seen = 0;
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            seen += buckets[b];
+            if (seen >= rank)
+                return std::min(bucketHighest(b), max);
+        }
+        return max;
+    }
+    double mean() const {
+        return count ? static_cast<double>(sum) / count : 0;
+    }
+};
+
+struct Snapshot {
+    std::array<uint64_t, COUNTERS> counters{};
+    std::array<LatencySnapshot, HISTOGRAMS> latencies;
+    std::vector<GaugeSample> gauges;
+};
+
+void addShard(Snapshot &snapshot, const Shard &shard) {
+    for (size_t i = 0; i < COUNTERS; ++i) {
+        snapshot.counters[i] += shard.counters[i].load(std::memory_order_relaxed);
+    }
+    for (size_t h = 0; h < HISTOGRAMS; ++h) {
+        const LatencyCells &cells = shard.latencies[h];
+        LatencySnapshot &latency = snapshot.latencies[h];
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            latency.buckets[b] += cells.buckets[b].load(std::memory_order_relaxed);
+        }
+        latency.count += cells.count.load(std::memory_order_relaxed);
+        latency.sum += cells.sum.load(std::memory_order_relaxed);
+        latency.max = std::max(latency.max, cells.max.load(std::memory_order_relaxed));
+    }
+}
+
+Snapshot takeSnapshot() {
+    Snapshot snapshot;
+    std::vector<GaugeSource> sources;
+    {
+        Registry &r = registry();
+        std::lock_guard lock(r.mutex);
+        addShard(snapshot, r.retired);
+        for (const Shard *shard : r.live) {
+            addShard(snapshot, *shard);
+        }
+        sources = r.gauge_sources;
+    }
+    // Samples of one gauge have to be adjacent in the Prometheus output
+    for (const auto &source : sources) {
+        source(snapshot.gauges);
+    }
+    std::stable_sort(snapshot.gauges.begin(), snapshot.gauges.end(),
+                     [](const GaugeSample &lhs, const GaugeSample &rhs) { return lhs.name < rhs.name; });
+    return snapshot;
+}
+
+std::string formatNumber(const char *format, double value) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), format, value);
+    return buffer;
+}
+
+std::string formatGauge(double value) {
+    return formatNumber(value == std::floor(value) && std::abs(value) < 1e15 ? "%.0f" : "%.3f", value);
+}
+
+std::string formatMicros(double nanos) {
+    return formatNumber("%.1f", nanos / 1e3);
+}
+
+std::string formatSeconds(double nanos) {
+    return formatNumber("%.9g", nanos / 1e9);
+}
+}  // namespace
+
+void countEvent(Counter counter, uint64_t delta) {
+    add(localShard().counters[static_cast<size_t>(counter)], delta);
+}
+
+void recordLatency(Histogram histogram, std::chrono::nanoseconds latency) {
+    uint64_t nanos = std::max<int64_t>(latency.count(), 0);
+    LatencyCells &cells = localShard().latencies[static_cast<size_t>(histogram)];
+    add(cells.buckets[bucketOf(nanos)], 1);
+    add(cells.count, 1);
+    add(cells.sum, nanos);
+    raise(cells.max, nanos);
+}
+
+void registerGaugeSource(GaugeSource source) {
+    Registry &r = registry();
+    std::lock_guard lock(r.mutex);
+    r.gauge_sources.push_back(std::move(source));
+}
+
+std::string renderStats() {
+    Snapshot snapshot = takeSnapshot();
+    std::string out = "{";
+    auto field = [&](const std::string &name, const std::string &value) {
+        if (out.size() > 1) {
+            out += ' ';
+        }
+        out += name;
+        out += ':';
+        out += value;
+    };
+
+    for (size_t i = 0; i < COUNTERS; ++i) {
+        field(COUNTER_NAMES[i], std::to_string(snapshot.counters[i]));
+    }
+    for (size_t h = 0; h < HISTOGRAMS; ++h) {
+        const LatencySnapshot &latency = snapshot.latencies[h];
+        std::string name = HISTOGRAM_NAMES[h];
+        field(name + "_count", std::to_string(latency.count));
+        field(name + "_mean_us", formatMicros(latency.mean()));
+        for (const auto &[q, suffix] : QUANTILES) {
+            field(name + "_" + suffix + "_us", formatMicros(latency.quantile(q)));
+        }
+        field(name + "_max_us", formatMicros(latency.max));
+    }
+    for (const auto &gauge : snapshot.gauges) {
+        field(gauge.label_value.empty() ? gauge.name : gauge.name + "_" + gauge.label_value, formatGauge(gauge.value));
+    }
+    out += "}";
+    return out;
+}
+
+std::string renderPrometheus() {
+    Snapshot snapshot = takeSnapshot();
+    std::string out;
+
+    for (size_t i = 0; i < COUNTERS; ++i) {
+        std::string name = std::string("redka_") + COUNTER_NAMES[i] + "_total";
+        out += "# TYPE " + name + " counter\n";
+        out += name + " " + std::to_string(snapshot.counters[i]) + "\n";
+    }
+    for (size_t h = 0; h < HISTOGRAMS; ++h) {
+        const LatencySnapshot &latency = snapshot.latencies[h];
+        std::string name = std::string("redka_") + HISTOGRAM_NAMES[h] + "_latency_seconds";
+        out += "# TYPE " + name + " summary\n";
+        for (const auto &[q, suffix] : QUANTILES) {
+            out += name + "{quantile=\"" + formatNumber("%g", q) + "\"} " + formatSeconds(latency.quantile(q)) + "\n";
+        }
+        out += name + "_sum " + formatSeconds(latency.sum) + "\n";
+        out += name + "_count " + std::to_string(latency.count) + "\n";
+    }
+    std::string previous;
+    for (const auto &gauge : snapshot.gauges) {
+        std::string name = "redka_" + gauge.name;
+        if (name != previous) {
+            out += "# TYPE " + name + " gauge\n";
+            previous = name;
+        }
+        out += name;
+        if (!gauge.label_name.empty()) {
+            out += "{" + gauge.label_name + "=\"" + gauge.label_value + "\"}";
+        }
+        out += " " + formatGauge(gauge.value) + "\n";
+    }
+    return out;
+}
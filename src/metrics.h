@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Process-wide metrics. Every thread updates its own shard with plain relaxed
+// stores, so recording costs no more than a few uncontended memory writes and
+// stays on in production; readers sum the shards of live threads with the
+// totals left by threads that have exited.
+
+enum class Counter {
+    reads,
+    read_misses,
+    multi_gets,
+    scans,
+    creates,
+    updates,
+    batches,
+    wal_bytes,
+    write_stalls,
+    write_stall_micros,
+    flushes,
+    flushed_bytes,
+    compactions,
+    compacted_bytes,
+    connections,
+    replicated_entries,
+    replica_snapshots,
+    busy_rejections,
+    accept_pauses,
+    busy_connections,
+    idle_disconnects,
+    wal_idle_flushes,
+    rdx_connections,
+    COUNT,
+};
+
+// Latencies are kept in log-linear buckets (16 per power of two), so any
+// percentile is within 1/16 of the recorded value whatever its magnitude
+enum class Histogram {
+    read,
+    create,
+    update,
+    batch,
+    wal_append,
+    wal_sync,
+    flush,
+    compaction,
+    COUNT,
+};
+
+void countEvent(Counter counter, uint64_t delta = 1);
+void recordLatency(Histogram histogram, std::chrono::nanoseconds latency);
+
+// Records the time from construction to destruction
+class LatencyTimer {
+private:
+    Histogram histogram;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit LatencyTimer(Histogram histogram) : histogram(histogram), start(std::chrono::steady_clock::now()) {
+    }
+    ~LatencyTimer() {
+        recordLatency(histogram, std::chrono::steady_clock::now() - start);
+    }
+    LatencyTimer(const LatencyTimer &) = delete;
+    LatencyTimer &operator=(const LatencyTimer &) = delete;
+};
+
+// Gauges are sampled when the metrics are rendered. A sample may carry one
+// label, e.g. level="0" for the per-level LSM gauges
+struct GaugeSample {
+    std::string name;
+    std::string label_name;
+    std::string label_value;
+    double value;
+};
+
+using GaugeSource = std::function<void(std::vector<GaugeSample> &)>;
+
+// Sources are called on the thread that renders the metrics
+void registerGaugeSource(GaugeSource source);
+
+// All metrics as one record: {reads:12 read_p99_us:40.5 level_files_0:3 ...}
+std::string renderStats();
+// Prometheus text exposition format; latencies are summaries in seconds
+std::string renderPrometheus();
@@ -1,6 +1,9 @@
 #include "net.h"
 
+#include <netinet/tcp.h>
+
 #include <cassert>
+#include <cerrno>
 #include <ranges>
 #include <stdexcept>
 
@@ -11,6 +14,9 @@ CoroResult<size_t> TcpSocket::WriteAll(std::span<const char> view) {
     size_t all_written = 0;
     while (!view.empty()) {
         size_t num_written = co_await WriteSome(view);
+        if (num_written == 0) {
+            break;
+        }
         view = view.subspan(num_written);
         all_written += num_written;
     }
@@ -19,16 +25,33 @@ CoroResult<size_t> TcpSocket::WriteAll(std::span<const char> view) {
 }
 
 CoroResult<size_t> TcpSocket::WriteSome(std::span<const char> view) {
-    CoroResult<size_t>* this_coro = co_await ThisCoro;
-    parent_->RegisterWrite(fd_, this_coro);
-    co_await std::suspend_always{};
-    co_return send(fd_, view.data(), view.size(), 0);
+    // Optimistic path: the socket is almost always writable, so try first and
+    // only park on the poller when the kernel buffer is full
+    while (true) {
+        ssize_t num_written = send(fd_, view.data(), view.size(), MSG_NOSIGNAL);
+        if (num_written >= 0) {
+            co_return num_written;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return 0;
+        }
+
+        CoroResult<size_t>* this_coro = co_await ThisCoro;
+        parent_->RegisterWrite(fd_, this_coro);
+        co_await std::suspend_always{};
+    }
 }
 
 CoroResult<size_t> TcpSocket::ReadAll(std::span<char> view) {
     size_t all_read = 0;
     while (!view.empty()) {
         size_t num_read = co_await ReadSome(view);
+        if (num_read == 0) {
+            break;
+        }
         view = view.subspan(num_read);
         all_read += num_read;
     }
@@ -37,10 +60,27 @@ CoroResult<size_t> TcpSocket::ReadAll(std::span<char> view) {
 }
 
 CoroResult<size_t> TcpSocket::ReadSome(std::span<char> view) {
-    CoroResult<size_t>* this_coro = co_await ThisCoro;
-    parent_->RegisterRead(fd_, this_coro);
-    co_await std::suspend_always{};
-    co_return recv(fd_, view.data(), view.size(), 0);
+    while (true) {
+        ssize_t num_read = recv(fd_, view.data(), view.size(), 0);
+        if (num_read >= 0) {
+            co_return num_read;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            // Treat errors as a closed connection
+            co_return 0;
+        }
+
+        CoroResult<size_t>* this_coro = co_await ThisCoro;
+        parent_->RegisterRead(fd_, this_coro);
+        co_await std::suspend_always{};
+    }
+}
+
+void TcpSocket::Shutdown() {
+    shutdown(fd_, SHUT_RDWR);
 }
 
 TcpSocket::TcpSocket(TcpSocket&& other) noexcept
@@ -66,22 +106,63 @@ Acceptor::~Acceptor() {
 Acceptor::Acceptor(sockaddr_in addr, Acceptor::PrivateTag) : addr_(addr) {
 }
 
-CoroResult<TcpSocket> Acceptor::Accept() {
+CoroResult<std::optional<TcpSocket>> Acceptor::Accept() {
     assert(opened_);
-    CoroResult<TcpSocket>* this_coro = co_await ThisCoro;
-    RegisterRead(serverfd_, this_coro);
-    co_await std::suspend_always{};
     sockaddr_in client_addr;
     socklen_t addr_len = sizeof(client_addr);
     int client_fd;
 
-    if ((client_fd = accept(serverfd_, (sockaddr*)&client_addr, &addr_len)) < 0) {
-        throw std::runtime_error{"accept failed"};
+    while ((client_fd = accept4(serverfd_, (sockaddr*)&client_addr, &addr_len, SOCK_NONBLOCK)) < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            co_return std::nullopt;
+        }
+
+        CoroResult<std::optional<TcpSocket>>* this_coro = co_await ThisCoro;
+        RegisterRead(serverfd_, this_coro);
+        co_await std::suspend_always{};
+        addr_len = sizeof(client_addr);
     }
 
+    // Responses are small, do not let Nagle hold them back
+    int opt = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
     co_return TcpSocket(this, client_fd);
 }
 
+CoroResult<std::optional<TcpSocket>> Acceptor::Connect(sockaddr_in addr) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        co_return std::nullopt;
+    }
+    // Closes the descriptor on every failure below
+    TcpSocket socket(this, fd);
+
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (errno != EINPROGRESS) {
+            co_return std::nullopt;
+        }
+
+        CoroResult<std::optional<TcpSocket>>* this_coro = co_await ThisCoro;
+        RegisterWrite(fd, this_coro);
+        co_await std::suspend_always{};
+
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error != 0) {
+            co_return std::nullopt;
+        }
+    }
+
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    co_return std::move(socket);
+}
+
 void Acceptor::RegisterEvent(Acceptor::EventType type, int fd, ITask* task) {
     using enum EventType;
     auto& poll_event = events_[fd];
@@ -104,7 +185,7 @@ void Acceptor::RegisterEvent(Acceptor::EventType type, int fd, ITask* task) {
     *cont = task;
 }
 
-void Acceptor::PollAll(Executor* executor) {
+void Acceptor::PollAll(Executor* executor, int timeout_ms) {
     namespace rv = std::ranges::views;
     assert(executor);
 
@@ -131,26 +212,25 @@ void Acceptor::PollAll(Executor* executor) {
                       }),
                       std::back_inserter(pollfds_));
 
-    poll(pollfds_.data(), pollfds_.size(), -1);
+    poll(pollfds_.data(), pollfds_.size(), timeout_ms);
 
     for (auto pfd : pollfds_) {
         auto& pevent = events_[pfd.fd];
 
-        // TODO handle err and hang up
-        //
-        if (pfd.revents & POLLOUT) {
-            assert(pevent.write_cont);
+        // Errors and hang-ups wake both sides, their next read or write
+        // reports them; a refused connect may get nothing but POLLERR
+        bool failed = pfd.revents & (POLLERR | POLLHUP | POLLNVAL);
+        if ((pfd.revents & POLLOUT || failed) && pevent.write_cont) {
             executor->Schedule(std::exchange(pevent.write_cont, nullptr));
         }
 
-        if (pfd.revents & (POLLIN)) {
-            assert(pevent.read_cont);
+        if ((pfd.revents & POLLIN || failed) && pevent.read_cont) {
             executor->Schedule(std::exchange(pevent.read_cont, nullptr));
         }
     }
 }
 
-void Acceptor::BindListen() {
+void Acceptor::BindListen(int backlog) {
     if ((serverfd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
         throw std::runtime_error{"socket creation failed"};
     }
@@ -166,14 +246,14 @@ void Acceptor::BindListen() {
         throw std::runtime_error{"bind failed"};
     }
 
-    if (listen(serverfd_, 128) < 0) {
+    if (listen(serverfd_, backlog) < 0) {
         throw std::runtime_error{"listen failed"};
     }
 }
 
-std::unique_ptr<Acceptor> Acceptor::ListenOn(sockaddr_in addr) {
+std::unique_ptr<Acceptor> Acceptor::ListenOn(sockaddr_in addr, int backlog) {
     auto acceptor = std::make_unique<Acceptor>(addr, PrivateTag{});
-    acceptor->BindListen();
+    acceptor->BindListen(backlog);
     return acceptor;
 }
 }  // namespace redka::io
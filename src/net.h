@@ -12,11 +12,11 @@
 
 #include <span>
 #include <memory>
+#include <optional>
 #include <unordered_map>
 #include <vector>
 
 namespace redka::io {
-    constexpr size_t kMaxFds = 1024;
     class Acceptor;
 
 
@@ -43,6 +43,10 @@ namespace redka::io {
         CoroResult<size_t> ReadSome(std::span<char> view);
 
         CoroResult<size_t> ReadAll(std::span<char> view);
+
+        // Ends the connection both ways but keeps the descriptor: a pending
+        // read or write wakes up and returns 0, as on a closed connection
+        void Shutdown();
     private:
         Acceptor* parent_;
         int fd_{};
@@ -57,10 +61,15 @@ namespace redka::io {
             write,
         };
     public:
-        static std::unique_ptr<Acceptor> ListenOn(sockaddr_in addr);
+        static std::unique_ptr<Acceptor> ListenOn(sockaddr_in addr, int backlog = SOMAXCONN);
 
         Acceptor(sockaddr_in addr, PrivateTag);
-        CoroResult<TcpSocket> Accept();
+        // Empty when the connection could not be taken, e.g. with the
+        // process out of descriptors; it stays in the backlog
+        CoroResult<std::optional<TcpSocket>> Accept();
+
+        // Outgoing connection served by the same poller; empty if it failed
+        CoroResult<std::optional<TcpSocket>> Connect(sockaddr_in addr);
 
         void RegisterRead(int fd, ITask* task) {
             RegisterEvent(EventType::read, fd, task);
@@ -69,11 +78,12 @@ namespace redka::io {
             RegisterEvent(EventType::write, fd, task);
         }
 
-        void PollAll(Executor* executor);
+        // Waits up to `timeout_ms` (-1: indefinitely) and schedules the ready tasks
+        void PollAll(Executor* executor, int timeout_ms = -1);
         ~Acceptor();
 
     private:
-        void BindListen();
+        void BindListen(int backlog);
 
         void RegisterEvent(EventType type, int fd, ITask* task);
 
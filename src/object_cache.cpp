@@ -0,0 +1,180 @@
+#include "object_cache.h"
+
+namespace {
+int hexValue(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+}  // namespace
+
+bool parseRecordKey(std::string_view id, RecordKey &key) {
+    if (id.size() != 36)
+        return false;
+
+    key = {};
+    size_t digits = 0;
+    for (size_t i = 0; i < id.size(); ++i) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (id[i] != '-')
+                return false;
+            continue;
+        }
+
+        int value = hexValue(id[i]);
+        if (value < 0)
+            return false;
+        uint64_t &half = digits < 16 ? key.hi : key.lo;
+        half = (half << 4) | static_cast<uint64_t>(value);
+        ++digits;
+    }
+    return true;
+}
+
+std::string formatRecordKey(const RecordKey &key) {
+    static const char DIGITS[] = "0123456789abcdef";
+    std::string id(36, '-');
+    size_t pos = 0;
+    for (int digit = 0; digit < 32; ++digit) {
+        if (pos == 8 || pos == 13 || pos == 18 || pos == 23) {
+            ++pos;
+        }
+        uint64_t half = digit < 16 ? key.hi : key.lo;
+        id[pos++] = DIGITS[(half >> (60 - 4 * (digit % 16))) & 0xf];
+    }
+    return id;
+}
+
+ObjectCache::ObjectCache(size_t byte_budget) : byte_budget(byte_budget) {
+}
+
+size_t ObjectCache::recordBytes(const MergeMap &record) {
+    // Rough footprint: map nodes plus string payloads
+    size_t bytes = sizeof(Slot) + sizeof(MergeMap) + 64;
+    for (const auto &[field, versionedValue] : record) {
+        bytes += 64 + sizeof(field) + versionedValue.second.size();
+    }
+    return bytes;
+}
+
+std::shared_ptr<const MergeMap> ObjectCache::lookup(const RecordKey &key) {
+    auto it = index.find(key);
+    if (it == index.end())
+        return nullptr;
+
+    Slot &slot = slots[it->second];
+    slot.referenced = true;
+    return slot.record;
+}
+
+void ObjectCache::insert(const RecordKey &key, std::shared_ptr<const MergeMap> record) {
+    erase(key);
+
+    size_t bytes = recordBytes(*record);
+    if (bytes > byte_budget)
+        return;
+    while (used_bytes + bytes > byte_budget && !index.empty()) {
+        evictOne();
+    }
+
+    size_t slot_id;
+    if (!free_slots.empty()) {
+        slot_id = free_slots.back();
+        free_slots.pop_back();
+    } else {
+        slot_id = slots.size();
+        slots.emplace_back();
+    }
+
+    // New entries start unreferenced: one-off reads are evicted on the first sweep
+    slots[slot_id] = {key, std::move(record), bytes, false};
+    index[key] = slot_id;
+    used_bytes += bytes;
+}
+
+void ObjectCache::applyWrite(const RecordKey &key, const std::string &logEntry) {
+    auto it = index.find(key);
+    if (it == index.end())
+        return;
+
+    auto updated = std::make_shared<MergeMap>(*slots[it->second].record);
+    mergeNewerRecordIntoMap(*updated, logEntry);
+    bool referenced = slots[it->second].referenced;
+    insert(key, std::move(updated));
+
+    it = index.find(key);
+    if (it != index.end()) {
+        slots[it->second].referenced = referenced;
+    }
+}
+
+void ObjectCache::erase(const RecordKey &key) {
+    auto it = index.find(key);
+    if (it == index.end())
+        return;
+
+    size_t slot_id = it->second;
+    index.erase(it);
+    release(slot_id);
+}
+
+void ObjectCache::release(size_t slot_id) {
+    Slot &slot = slots[slot_id];
+    used_bytes -= slot.bytes;
+    slot.record.reset();
+    slot.bytes = 0;
+    slot.referenced = false;
+    free_slots.push_back(slot_id);
+}
+
+void ObjectCache::evictOne() {
+    // CLOCK: referenced entries get a second chance, the first cold one goes
+    while (true) {
+        if (clock_hand >= slots.size()) {
+            clock_hand = 0;
+        }
+
+        Slot &slot = slots[clock_hand];
+        size_t slot_id = clock_hand++;
+        if (!slot.record)
+            continue;
+        if (slot.referenced) {
+            slot.referenced = false;
+            continue;
+        }
+
+        index.erase(slot.key);
+        release(slot_id);
+        return;
+    }
+}
+
+NegativeCache::NegativeCache(size_t capacity) : capacity(capacity), ring(capacity), live(capacity, false) {
+}
+
+void NegativeCache::insert(const RecordKey &key) {
+    if (capacity == 0 || contains(key))
+        return;
+
+    // Overwrite the oldest entry
+    if (live[next_slot]) {
+        index.erase(ring[next_slot]);
+    }
+    ring[next_slot] = key;
+    live[next_slot] = true;
+    index[key] = next_slot;
+    next_slot = (next_slot + 1) % capacity;
+}
+
+void NegativeCache::erase(const RecordKey &key) {
+    auto it = index.find(key);
+    if (it == index.end())
+        return;
+
+    live[it->second] = false;
+    index.erase(it);
+}
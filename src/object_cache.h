@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "merge_records.h"
+
+// 128-bit record id, parsed from the textual UUID
+struct RecordKey {
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+
+    bool operator==(const RecordKey &other) const {
+        return hi == other.hi && lo == other.lo;
+    }
+};
+
+struct RecordKeyHash {
+    size_t operator()(const RecordKey &key) const {
+        // UUIDv4 bits are random already, just fold the halves
+        return key.hi ^ (key.lo * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+// Parses "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx" without allocating
+bool parseRecordKey(std::string_view id, RecordKey &key);
+// The canonical lowercase text form, the one ids are generated in
+std::string formatRecordKey(const RecordKey &key);
+
+// Bounded cache of fully merged records (WAL + all SST levels) with CLOCK
+// eviction under a byte budget. Records are immutable and shared, a write
+// replaces the cached record with an updated copy.
+class ObjectCache {
+private:
+    struct Slot {
+        RecordKey key;
+        std::shared_ptr<const MergeMap> record;
+        size_t bytes = 0;
+        bool referenced = false;
+    };
+
+    size_t byte_budget;
+    size_t used_bytes = 0;
+    std::vector<Slot> slots;
+    std::vector<size_t> free_slots;
+    std::unordered_map<RecordKey, size_t, RecordKeyHash> index;
+    size_t clock_hand = 0;
+
+    static size_t recordBytes(const MergeMap &record);
+    void evictOne();
+    void release(size_t slot);
+
+public:
+    explicit ObjectCache(size_t byte_budget);
+
+    std::shared_ptr<const MergeMap> lookup(const RecordKey &key);
+    void insert(const RecordKey &key, std::shared_ptr<const MergeMap> record);
+    // Applies a write of `logEntry` to the cached record, if there is one
+    void applyWrite(const RecordKey &key, const std::string &logEntry);
+    void erase(const RecordKey &key);
+
+    size_t size() const {
+        return index.size();
+    }
+    size_t bytes() const {
+        return used_bytes;
+    }
+};
+
+// Ids known to exist nowhere (WAL or any level), so that repeated lookups of
+// unknown ids are answered without probing the storage. Bounded FIFO; a write
+// to an id must erase it.
+class NegativeCache {
+private:
+    size_t capacity;
+    std::vector<RecordKey> ring;
+    std::vector<bool> live;
+    size_t next_slot = 0;
+    std::unordered_map<RecordKey, size_t, RecordKeyHash> index;
+
+public:
+    explicit NegativeCache(size_t capacity);
+
+    bool contains(const RecordKey &key) const {
+        return index.find(key) != index.end();
+    }
+    void insert(const RecordKey &key);
+    void erase(const RecordKey &key);
+
+    size_t size() const {
+        return index.size();
+    }
+};
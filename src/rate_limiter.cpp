@@ -0,0 +1,55 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+#include <thread>
+
+RateLimiter::RateLimiter(double bytes_per_second, double burst_seconds)
+    : bytes_per_second(bytes_per_second), burst_seconds(burst_seconds), last_refill(Clock::now()) {
+}
+
+void RateLimiter::refill(Clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - last_refill).count();
+    last_refill = now;
+    tokens = std::min(tokens + elapsed * bytes_per_second, bytes_per_second * burst_seconds);
+}
+
+void RateLimiter::setRate(double new_rate) {
+    std::lock_guard lock(mutex);
+    refill(Clock::now());
+    bytes_per_second = new_rate;
+}
+
+double RateLimiter::rate() {
+    std::lock_guard lock(mutex);
+    return bytes_per_second;
+}
+
+void RateLimiter::request(size_t bytes) {
+    std::chrono::duration<double> wait{};
+    {
+        std::lock_guard lock(mutex);
+        refill(Clock::now());
+        tokens -= bytes;
+        // The bytes are ours; sleep off the debt outside the lock
+        if (tokens < 0) {
+            wait = std::chrono::duration<double>(-tokens / bytes_per_second);
+        }
+    }
+    if (wait.count() > 0) {
+        std::this_thread::sleep_for(wait);
+    }
+}
+
+void RateLimiter::charge(size_t bytes) {
+    std::lock_guard lock(mutex);
+    refill(Clock::now());
+    tokens -= bytes;
+}
+
+std::chrono::microseconds RateLimiter::debtDelay() {
+    std::lock_guard lock(mutex);
+    refill(Clock::now());
+    if (tokens >= 0)
+        return std::chrono::microseconds(0);
+    return std::chrono::microseconds(static_cast<int64_t>(-tokens / bytes_per_second * 1e6));
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+
+// Token bucket over bytes written by flushes and compactions. Background
+// threads block in request(); the request thread never sleeps, it charge()s
+// and turns the resulting debt into a delay of the next write.
+class RateLimiter {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::mutex mutex;
+    double bytes_per_second;
+    // Balance in bytes, negative while in debt; capped at `burst` seconds worth
+    double tokens = 0;
+    double burst_seconds;
+    Clock::time_point last_refill;
+
+    void refill(Clock::time_point now);
+
+public:
+    RateLimiter(double bytes_per_second, double burst_seconds = 0.1);
+
+    void setRate(double bytes_per_second);
+    double rate();
+    // Takes `bytes` from the bucket, sleeping until the balance allows it
+    void request(size_t bytes);
+    // Takes `bytes` without waiting; the bucket may go into debt
+    void charge(size_t bytes);
+    // Time until the debt is paid off, zero if there is none
+    std::chrono::microseconds debtDelay();
+};
@@ -0,0 +1,91 @@
+#include "rdx_binary.h"
+
+#include <algorithm>
+#include <cctype>
+
+RdxFrameHeader decodeFrameHeader(const char *bytes) {
+    std::string_view in(bytes + 1, RDX_FRAME_HEADER_SIZE - 1);
+    RdxFrameHeader header;
+    header.type = static_cast<uint8_t>(bytes[0]);
+    readRdxU32(in, header.length);
+    return header;
+}
+
+void appendFrameHeader(std::string &out, uint8_t type, uint32_t length) {
+    out += static_cast<char>(type);
+    appendRdxU32(out, length);
+}
+
+bool readRdxU32(std::string_view &in, uint32_t &value) {
+    if (in.size() < 4)
+        return false;
+    value = 0;
+    for (int i = 3; i >= 0; --i) {
+        value = (value << 8) | static_cast<uint8_t>(in[i]);
+    }
+    in.remove_prefix(4);
+    return true;
+}
+
+bool readRdxBytes(std::string_view &in, std::string_view &bytes) {
+    uint32_t size = 0;
+    if (!readRdxU32(in, size) || in.size() < size)
+        return false;
+    bytes = in.substr(0, size);
+    in.remove_prefix(size);
+    return true;
+}
+
+bool readRdxId(std::string_view &in, RecordKey &key) {
+    if (in.size() < RDX_ID_SIZE)
+        return false;
+    key = {};
+    for (size_t i = 0; i < RDX_ID_SIZE; ++i) {
+        uint64_t &half = i < 8 ? key.hi : key.lo;
+        half = (half << 8) | static_cast<uint8_t>(in[i]);
+    }
+    in.remove_prefix(RDX_ID_SIZE);
+    return true;
+}
+
+bool readRdxField(std::string_view &in, RdxField &field) {
+    return readRdxBytes(in, field.name) && readRdxU32(in, field.version) && readRdxBytes(in, field.value);
+}
+
+void appendRdxU32(std::string &out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out += static_cast<char>(value >> (8 * i));
+    }
+}
+
+void appendRdxId(std::string &out, const RecordKey &key) {
+    for (size_t i = 0; i < RDX_ID_SIZE; ++i) {
+        uint64_t half = i < 8 ? key.hi : key.lo;
+        out += static_cast<char>(half >> (56 - 8 * (i % 8)));
+    }
+}
+
+void appendRdxField(std::string &out, std::string_view name, uint32_t version, std::string_view value) {
+    appendRdxU32(out, name.size());
+    out += name;
+    appendRdxU32(out, version);
+    appendRdxU32(out, value.size());
+    out += value;
+}
+
+size_t rdxFieldSize(std::string_view name, std::string_view value) {
+    return 12 + name.size() + value.size();
+}
+
+bool isRdxFieldName(std::string_view name) {
+    return !name.empty() && std::all_of(name.begin(), name.end(), [](char c) {
+        return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+    });
+}
+
+bool isRdxFieldValue(std::string_view value) {
+    return !value.empty() && std::all_of(value.begin(), value.end(), [](char c) {
+        auto byte = static_cast<unsigned char>(c);
+        return byte > ' ' && byte != 0x7f && c != '{' && c != '}';
+    });
+}
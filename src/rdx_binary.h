@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "object_cache.h"
+
+// Binary RDX framing, for services that would rather not print and scan JDR.
+// A connection whose first byte is RDX_BINARY_MAGIC speaks it from then on;
+// any other first byte starts a JDR connection. Integers are little-endian.
+//
+//   request  := op:u8 length:u32 payload[length]
+//   response := kind:u8 length:u32 payload[length]
+//   id       := 16 bytes, the UUID big-endian
+//   field    := name_length:u32 name version:u32 value_length:u32 value
+//
+// Requests: get (id, then the names of the projected fields as
+// name_length:u32 name, none for the whole record), create (fields),
+// update (id, fields), multi-get (ids). Responses come in request order, one
+// per id for a multi-get: an id frame for a write, a record frame of fields
+// for a read, or a frame of kind 0..4 with no payload for the numeric result
+// codes (RDKAnone, RDKAbad, ...). Names and values are the JDR text of the
+// record, so a field reads back the same over either protocol.
+//
+// Decoding is a walk over the payload that checks every length against what
+// is left and fails instead of reading past the end.
+
+const char RDX_BINARY_MAGIC = '\0';
+const size_t RDX_FRAME_HEADER_SIZE = 5;
+const size_t RDX_ID_SIZE = 16;
+
+enum class RdxOp : uint8_t {
+    get = 1,
+    create = 2,
+    update = 3,
+    multiGet = 4,
+};
+
+// Response kinds past the result codes
+const uint8_t RDX_ID_FRAME = 0x10;
+const uint8_t RDX_RECORD_FRAME = 0x11;
+
+struct RdxFrameHeader {
+    uint8_t type = 0;
+    uint32_t length = 0;
+};
+
+// `bytes` holds RDX_FRAME_HEADER_SIZE bytes
+RdxFrameHeader decodeFrameHeader(const char *bytes);
+void appendFrameHeader(std::string &out, uint8_t type, uint32_t length);
+
+struct RdxField {
+    std::string_view name;
+    uint32_t version = 0;
+    std::string_view value;
+};
+
+// Read from the front of `in` and advance it; false on truncated input
+bool readRdxU32(std::string_view &in, uint32_t &value);
+bool readRdxBytes(std::string_view &in, std::string_view &bytes);
+bool readRdxId(std::string_view &in, RecordKey &key);
+bool readRdxField(std::string_view &in, RdxField &field);
+
+void appendRdxU32(std::string &out, uint32_t value);
+void appendRdxId(std::string &out, const RecordKey &key);
+void appendRdxField(std::string &out, std::string_view name, uint32_t version, std::string_view value);
+size_t rdxFieldSize(std::string_view name, std::string_view value);
+
+// Whether a name or value goes into a JDR record as is: names are words,
+// values single tokens without spaces, braces or control characters
+bool isRdxFieldName(std::string_view name);
+bool isRdxFieldValue(std::string_view value);
@@ -0,0 +1,26 @@
+#include "replication.h"
+
+#include <random>
+
+ReplicationLog::ReplicationLog(size_t max_bytes) : max_bytes(max_bytes) {
+    std::random_device random;
+    do {
+        log_epoch = (static_cast<uint64_t>(random()) << 32) | random();
+    } while (log_epoch == 0);
+}
+
+uint64_t ReplicationLog::append(const std::string &entry) {
+    entries.push_back(entry);
+    bytes += entry.size();
+    // The newest entry stays whatever its size
+    while (bytes > max_bytes && entries.size() > 1) {
+        bytes -= entries.front().size();
+        entries.pop_front();
+        ++first_seq;
+    }
+    return lastSeq();
+}
+
+bool ReplicationLog::canResumeFrom(uint64_t epoch, uint64_t seq) const {
+    return epoch == log_epoch && seq + 1 >= first_seq && seq <= lastSeq();
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+// Writes in the order they were applied, numbered from 1, for followers to
+// tail. Only the most recent ones are kept, up to a byte budget; a follower
+// that falls behind them catches up from a snapshot instead. The epoch is
+// drawn at startup, positions from another run of the primary mean nothing.
+// Used by the request thread only.
+class ReplicationLog {
+private:
+    std::deque<std::string> entries;
+    uint64_t first_seq = 1;
+    size_t bytes = 0;
+    size_t max_bytes;
+    uint64_t log_epoch;
+
+public:
+    explicit ReplicationLog(size_t max_bytes);
+
+    // Returns the sequence number of the entry
+    uint64_t append(const std::string &entry);
+
+    // Never 0, followers without a position send 0
+    uint64_t epoch() const {
+        return log_epoch;
+    }
+    // 0 before the first write
+    uint64_t lastSeq() const {
+        return first_seq + entries.size() - 1;
+    }
+    // Whether a follower that applied everything up to `seq` can go on with
+    // the retained entries
+    bool canResumeFrom(uint64_t epoch, uint64_t seq) const;
+    // `seq` must be retained
+    const std::string &entry(uint64_t seq) const {
+        return entries[seq - first_seq];
+    }
+};
@@ -0,0 +1,150 @@
+#include "timer_wheel.h"
+
+#include <bit>
+
+namespace redka::io {
+    namespace {
+        constexpr uint64_t kSlotMask = TimerWheel::kSlots - 1;
+    }
+
+    TimerWheel::TimerWheel(Clock::time_point start)
+        : start_(start) {
+    }
+
+    uint64_t TimerWheel::TickOf(Clock::time_point deadline) const {
+        if (deadline <= start_) {
+            return 0;
+        }
+        return std::chrono::ceil<std::chrono::milliseconds>(deadline - start_).count();
+    }
+
+    void TimerWheel::Add(Timer& timer, Clock::time_point deadline, ITask* task) {
+        assert(!timer.IsLinked());
+
+        timer.tick_ = TickOf(deadline);
+        timer.task_ = task;
+        ++size_;
+        Insert(timer);
+    }
+
+    void TimerWheel::Insert(Timer& timer) {
+        if (timer.tick_ <= now_tick_) {
+            timer.level_ = kExpired;
+            expired_.Push(&timer);
+            return;
+        }
+
+        // The highest group of bits where the deadline differs from now picks
+        // the level, the deadline's bits in that group the slot
+        size_t level = (std::bit_width(timer.tick_ ^ now_tick_) - 1) / kSlotBits;
+        size_t slot;
+        if (level < kLevels) {
+            slot = (timer.tick_ >> (kSlotBits * level)) & kSlotMask;
+        } else {
+            // Further than the top level reaches: slot 0 is never due in the
+            // current rotation and is looked at again when the next one starts
+            level = kLevels - 1;
+            slot = 0;
+        }
+
+        timer.level_ = static_cast<uint8_t>(level);
+        timer.slot_ = static_cast<uint8_t>(slot);
+        slots_[level][slot].Push(&timer);
+        occupied_[level] |= uint64_t{1} << slot;
+    }
+
+    bool TimerWheel::Cancel(Timer& timer) {
+        if (!timer.IsLinked()) {
+            return false;
+        }
+
+        auto& queue = QueueOf(timer);
+        queue.Remove(&timer);
+        if (timer.level_ != kExpired && queue.Empty()) {
+            occupied_[timer.level_] &= ~(uint64_t{1} << timer.slot_);
+        }
+        --size_;
+        return true;
+    }
+
+    void TimerWheel::Cascade(size_t level, size_t slot) {
+        auto& queue = slots_[level][slot];
+        occupied_[level] &= ~(uint64_t{1} << slot);
+        // Timers still out of reach go back to this very slot
+        for (size_t left = queue.Size(); left > 0; --left) {
+            Insert(*queue.Pop());
+        }
+    }
+
+    void TimerWheel::FireAll(detail::IntrusiveQueue<Timer>& timers, detail::IntrusiveQueue<ITask>& due) {
+        while (Timer* timer = timers.Pop()) {
+            --size_;
+            due.Push(timer->task_);
+        }
+    }
+
+    void TimerWheel::Advance(Clock::time_point now, detail::IntrusiveQueue<ITask>& due) {
+        FireAll(expired_, due);
+
+        uint64_t target = now <= start_ ? 0 : (now - start_) / kTick;
+        while (now_tick_ < target) {
+            if (size_ == 0) {
+                now_tick_ = target;
+                break;
+            }
+
+            // Ticks with no level 0 timer and no level boundary are skipped
+            uint64_t next = occupied_[0] ? (now_tick_ & ~kSlotMask) | std::countr_zero(occupied_[0])
+                                         : (now_tick_ | kSlotMask) + 1;
+            if (next > target) {
+                now_tick_ = target;
+                break;
+            }
+            now_tick_ = next;
+
+            // Upper levels first: their timers may land in a lower slot that
+            // is cascaded right after
+            size_t top = 0;
+            while (top + 1 < kLevels && (now_tick_ & ((uint64_t{1} << (kSlotBits * (top + 1))) - 1)) == 0) {
+                ++top;
+            }
+            for (size_t level = top; level > 0; --level) {
+                Cascade(level, (now_tick_ >> (kSlotBits * level)) & kSlotMask);
+            }
+
+            size_t slot = now_tick_ & kSlotMask;
+            FireAll(slots_[0][slot], due);
+            occupied_[0] &= ~(uint64_t{1} << slot);
+            FireAll(expired_, due);
+        }
+    }
+
+    std::optional<TimerWheel::Clock::time_point> TimerWheel::NextExpiry() const {
+        auto timeOf = [this](uint64_t tick) {
+            return start_ + std::chrono::milliseconds(static_cast<int64_t>(tick));
+        };
+
+        if (!expired_.Empty()) {
+            return timeOf(now_tick_);
+        }
+
+        for (size_t level = 0; level < kLevels; ++level) {
+            if (!occupied_[level]) {
+                continue;
+            }
+
+            size_t shift = kSlotBits * level;
+            uint64_t current = (now_tick_ >> shift) & kSlotMask;
+            uint64_t rotation = now_tick_ >> (shift + kSlotBits) << (shift + kSlotBits);
+            // Slots not reached yet in this rotation; earlier ones only hold
+            // timers parked past the top level, due in the next rotation
+            uint64_t ahead = occupied_[level] & ~((uint64_t{2} << current) - 1);
+            if (ahead) {
+                return timeOf(rotation | (uint64_t(std::countr_zero(ahead)) << shift));
+            }
+            return timeOf(rotation + (uint64_t{1} << (shift + kSlotBits)) +
+                          (uint64_t(std::countr_zero(occupied_[level])) << shift));
+        }
+        return std::nullopt;
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "intrusive_queue.h"
+#include "task.h"
+
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+namespace redka::io {
+    class TimerWheel;
+
+    // A pending timer. Lives in the frame of the coroutine that waits on it,
+    // so arming one does not allocate
+    class Timer : public detail::Intrusive<Timer> {
+    public:
+        Timer() = default;
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+        ~Timer() {
+            assert(!IsLinked());
+        }
+
+        ITask* Task() const {
+            return task_;
+        }
+
+    private:
+        friend class TimerWheel;
+
+        uint64_t tick_{};
+        ITask* task_{};
+        uint8_t level_{};
+        uint8_t slot_{};
+    };
+
+    // Hierarchical timing wheel with 1 ms ticks: kLevels wheels of kSlots
+    // slots, level l holding the timers due in a later slot of the current
+    // rotation of level l + 1. Adding and cancelling are O(1), a timer is moved
+    // down at most kLevels - 1 times before it fires. Timers further out than
+    // the top level covers (about 4.6 hours) park in its first slot and are
+    // placed again at the start of each of its rotations
+    class TimerWheel {
+    public:
+        using Clock = std::chrono::steady_clock;
+
+        static constexpr auto kTick = std::chrono::milliseconds(1);
+        static constexpr size_t kSlotBits = 6;
+        static constexpr size_t kSlots = size_t{1} << kSlotBits;
+        static constexpr size_t kLevels = 4;
+
+        explicit TimerWheel(Clock::time_point start = Clock::now());
+
+        TimerWheel(const TimerWheel&) = delete;
+        TimerWheel& operator=(const TimerWheel&) = delete;
+
+        // `task` is queued once `deadline` has passed; a deadline in the past
+        // makes it due on the next Advance
+        void Add(Timer& timer, Clock::time_point deadline, ITask* task);
+
+        // False if the timer is not pending: it has fired or was never added
+        bool Cancel(Timer& timer);
+
+        // Queues the tasks of the timers due at `now`, earlier deadlines first
+        void Advance(Clock::time_point now, detail::IntrusiveQueue<ITask>& due);
+
+        // When Advance has something to do next, empty if no timer is pending.
+        // For timers on the upper levels that is when they move down, so the
+        // caller may wake up before any of them fires but never after
+        std::optional<Clock::time_point> NextExpiry() const;
+
+        size_t Size() const {
+            return size_;
+        }
+
+    private:
+        // Marks a timer that is due already
+        static constexpr uint8_t kExpired = kLevels;
+
+        // Rounded up, a timer never fires before its deadline
+        uint64_t TickOf(Clock::time_point deadline) const;
+
+        void Insert(Timer& timer);
+
+        // Places the timers of a slot again, on the lower levels
+        void Cascade(size_t level, size_t slot);
+
+        void FireAll(detail::IntrusiveQueue<Timer>& timers, detail::IntrusiveQueue<ITask>& due);
+
+        detail::IntrusiveQueue<Timer>& QueueOf(const Timer& timer) {
+            return timer.level_ == kExpired ? expired_ : slots_[timer.level_][timer.slot_];
+        }
+
+        Clock::time_point start_;
+        // Ticks since start_ processed by Advance
+        uint64_t now_tick_ = 0;
+        std::array<std::array<detail::IntrusiveQueue<Timer>, kSlots>, kLevels> slots_;
+        // Bit s of occupied_[l]: slot s of level l is not empty
+        std::array<uint64_t, kLevels> occupied_{};
+        detail::IntrusiveQueue<Timer> expired_;
+        size_t size_ = 0;
+    };
+}
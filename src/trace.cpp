@@ -0,0 +1,364 @@
+#include "trace.h"
+
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace {
+// Events per thread; a request is a handful of spans
+const size_t RING_CAPACITY = 1 << 14;
+// Rings of exited threads (subcompactions) kept for the next dump
+const size_t MAX_RETIRED_RINGS = 16;
+// Dumps asked for by clients, at most one per interval
+const auto MIN_DUMP_INTERVAL = std::chrono::seconds(10);
+
+std::atomic<uint32_t> sampling{0};
+thread_local uint32_t sample_counter = 0;
+thread_local uint64_t sampled_count = 0;
+thread_local bool scope_sampled = false;
+thread_local std::string thread_name;
+
+uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Pairs of ticks and time, two of them give the tick rate at dump time
+struct ClockReference {
+    uint64_t ticks;
+    std::chrono::steady_clock::time_point time;
+};
+
+ClockReference referenceNow() {
+    return {ticks(), std::chrono::steady_clock::now()};
+}
+
+const ClockReference START = referenceNow();
+
+// Fields are atomics only so that a dump racing with the writer is well-defined
+struct TraceEvent {
+    std::atomic<const char *> name{nullptr};
+    std::atomic<uint64_t> begin{0};
+    std::atomic<uint64_t> end{0};
+    std::atomic<uint64_t> async_id{0};
+};
+
+struct EventCopy {
+    const char *name;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t async_id;
+};
+
+// Single producer: only the owning thread pushes
+struct TraceRing {
+    std::unique_ptr<TraceEvent[]> events{new TraceEvent[RING_CAPACITY]};
+    std::atomic<uint64_t> head{0};
+    pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+    // Guarded by the registry mutex
+    std::string name;
+
+    void push(const char *event_name, uint64_t begin, uint64_t end, uint64_t async_id) {
+        uint64_t i = head.load(std::memory_order_relaxed);
+        TraceEvent &event = events[i & (RING_CAPACITY - 1)];
+        event.name.store(event_name, std::memory_order_relaxed);
+        event.begin.store(begin, std::memory_order_relaxed);
+        event.end.store(end, std::memory_order_relaxed);
+        event.async_id.store(async_id, std::memory_order_relaxed);
+        head.store(i + 1, std::memory_order_release);
+    }
+
+    std::vector<EventCopy> snapshot() const {
+        uint64_t last = head.load(std::memory_order_acquire);
+        uint64_t first = last > RING_CAPACITY ? last - RING_CAPACITY : 0;
+        std::vector<EventCopy> copies;
+        copies.reserve(last - first);
+        for (uint64_t i = first; i < last; ++i) {
+            const TraceEvent &event = events[i & (RING_CAPACITY - 1)];
+            copies.push_back({event.name.load(std::memory_order_relaxed), event.begin.load(std::memory_order_relaxed),
+                              event.end.load(std::memory_order_relaxed),
+                              event.async_id.load(std::memory_order_relaxed)});
+        }
+
+        // Drop the slots the writer reused while we copied, and the one it may be writing now
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t now = head.load(std::memory_order_relaxed);
+        uint64_t valid_from = now >= RING_CAPACITY ? now - RING_CAPACITY + 1 : 0;
+        if (valid_from > first) {
+            copies.erase(copies.begin(), copies.begin() + std::min<uint64_t>(valid_from - first, copies.size()));
+        }
+        return copies;
+    }
+};
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<TraceRing>> live;
+    std::deque<std::shared_ptr<TraceRing>> retired;
+};
+
+// Never destroyed: threads may exit during static destruction
+Registry &registry() {
+    static Registry *instance = new Registry;
+    return *instance;
+}
+
+thread_local TraceRing *local_ring = nullptr;
+
+// Rings are allocated on the first recorded span, threads that never trace pay nothing
+class RingOwner {
+private:
+    std::shared_ptr<TraceRing> ring = std::make_shared<TraceRing>();
+
+public:
+    RingOwner() {
+        Registry &r = registry();
+        std::lock_guard lock(r.mutex);
+        ring->name = thread_name;
+        r.live.push_back(ring);
+        local_ring = ring.get();
+    }
+    ~RingOwner() {
+        Registry &r = registry();
+        std::lock_guard lock(r.mutex);
+        r.live.erase(std::find(r.live.begin(), r.live.end(), ring));
+        r.retired.push_back(ring);
+        if (r.retired.size() > MAX_RETIRED_RINGS) {
+            r.retired.pop_front();
+        }
+        local_ring = nullptr;
+    }
+    RingOwner(const RingOwner &) = delete;
+    RingOwner &operator=(const RingOwner &) = delete;
+
+    TraceRing &get() {
+        return *ring;
+    }
+};
+
+TraceRing &localRing() {
+    thread_local RingOwner owner;
+    return owner.get();
+}
+
+int dump_pipe[2] = {-1, -1};
+// Path of the dump a client asked for, empty if none is waiting. A dump
+// signalled with no path waiting goes to a new one
+std::mutex dump_mutex;
+std::string requested_dump;
+std::chrono::steady_clock::time_point last_dump_request;
+
+void onDumpSignal(int) {
+    char byte = 0;
+    ssize_t ignored = write(dump_pipe[1], &byte, 1);
+    (void)ignored;
+}
+
+std::string jsonEscape(const std::string &text) {
+    std::string out;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+}  // namespace
+
+void setTraceSampling(uint32_t one_in) {
+    sampling.store(one_in, std::memory_order_relaxed);
+}
+
+uint32_t traceSampling() {
+    return sampling.load(std::memory_order_relaxed);
+}
+
+bool sampleTrace() {
+    uint32_t one_in = traceSampling();
+    if (one_in == 0 || ++sample_counter % one_in != 0)
+        return false;
+    ++sampled_count;
+    return true;
+}
+
+uint64_t sampledRequests() {
+    return sampled_count;
+}
+
+bool traceThisThread() {
+    return scope_sampled;
+}
+
+void setTraceThreadName(const std::string &name) {
+    thread_name = name;
+    if (local_ring) {
+        std::lock_guard lock(registry().mutex);
+        local_ring->name = name;
+    }
+}
+
+TraceScope::TraceScope(bool sampled) : previous(scope_sampled) {
+    scope_sampled = sampled;
+}
+
+TraceScope::~TraceScope() {
+    scope_sampled = previous;
+}
+
+TraceSpan::TraceSpan(const char *name, bool record, uint64_t async_id)
+    : name(name), async_id(async_id), record(record) {
+    if (record) {
+        begin = ticks();
+    }
+}
+
+TraceSpan::~TraceSpan() {
+    if (record) {
+        localRing().push(name, begin, ticks(), async_id);
+    }
+}
+
+bool dumpTrace(const std::string &path) {
+    std::vector<std::pair<std::shared_ptr<TraceRing>, std::string>> rings;
+    {
+        Registry &r = registry();
+        std::lock_guard lock(r.mutex);
+        for (const auto &ring : r.live) {
+            rings.emplace_back(ring, ring->name);
+        }
+        for (const auto &ring : r.retired) {
+            rings.emplace_back(ring, ring->name);
+        }
+    }
+
+    // Ticks are converted with the rate measured since startup
+    ClockReference now = referenceNow();
+    double elapsed_ns = std::chrono::duration<double, std::nano>(now.time - START.time).count();
+    double ticks_per_us = 1e3;
+    if (elapsed_ns > 0 && now.ticks > START.ticks) {
+        ticks_per_us = (now.ticks - START.ticks) / elapsed_ns * 1e3;
+    }
+    auto toMicros = [&](uint64_t at) {
+        return (static_cast<double>(at) - static_cast<double>(START.ticks)) / ticks_per_us;
+    };
+
+    std::ofstream out(path, std::ios::trunc);
+    int pid = getpid();
+    char event[256];
+    bool first = true;
+    auto emit = [&](const char *text) {
+        out << (first ? "\n" : ",\n") << text;
+        first = false;
+    };
+
+    out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+    for (const auto &[ring, name] : rings) {
+        if (!name.empty()) {
+            std::string metadata = "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " + std::to_string(pid) +
+                                   ", \"tid\": " + std::to_string(ring->tid) + ", \"args\": {\"name\": \"" +
+                                   jsonEscape(name) + "\"}}";
+            emit(metadata.c_str());
+        }
+        for (const auto &copy : ring->snapshot()) {
+            if (!copy.name || copy.end < copy.begin)
+                continue;
+            if (copy.async_id) {
+                // Async begin/end pairs, each id on a track of its own
+                for (const auto &[phase, at] : {std::pair{"b", copy.begin}, std::pair{"e", copy.end}}) {
+                    snprintf(event, sizeof(event),
+                             "{\"name\": \"%s\", \"cat\": \"request\", \"ph\": \"%s\", \"id\": %llu, "
+                             "\"pid\": %d, \"tid\": %d, \"ts\": %.3f}",
+                             copy.name, phase, static_cast<unsigned long long>(copy.async_id), pid, ring->tid,
+                             toMicros(at));
+                    emit(event);
+                }
+                continue;
+            }
+            snprintf(event, sizeof(event),
+                     "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                     copy.name, pid, ring->tid, toMicros(copy.begin), (copy.end - copy.begin) / ticks_per_us);
+            emit(event);
+        }
+    }
+    out << "\n]}\n";
+    return out.good();
+}
+
+std::string traceDumpPath() {
+    return "trace-" + std::to_string(getpid()) + "-" +
+           std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) + ".json";
+}
+
+bool requestTraceDump(std::string &path) {
+    if (dump_pipe[1] < 0)
+        return false;
+    {
+        std::lock_guard lock(dump_mutex);
+        auto now = std::chrono::steady_clock::now();
+        bool too_soon = last_dump_request != std::chrono::steady_clock::time_point{} &&
+                        now - last_dump_request < MIN_DUMP_INTERVAL;
+        if (!requested_dump.empty() || too_soon)
+            return false;
+        requested_dump = path = traceDumpPath();
+        last_dump_request = now;
+    }
+    onDumpSignal(0);
+    return true;
+}
+
+void installTraceDumpSignal(int signal) {
+    if (pipe(dump_pipe) != 0) {
+        perror("Trace dump pipe");
+        return;
+    }
+
+    std::thread([] {
+        setTraceThreadName("trace dump");
+        char byte;
+        while (true) {
+            ssize_t bytes = read(dump_pipe[0], &byte, 1);
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes != 1)
+                return;
+            std::string path;
+            {
+                std::lock_guard lock(dump_mutex);
+                path = requested_dump.empty() ? traceDumpPath() : std::move(requested_dump);
+                requested_dump.clear();
+            }
+            if (dumpTrace(path)) {
+                std::cerr << "Trace written to " << path << std::endl;
+            } else {
+                std::cerr << "Failed to write trace " << path << std::endl;
+            }
+        }
+    }).detach();
+
+    struct sigaction action {};
+    action.sa_handler = onDumpSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(signal, &action, nullptr);
+}
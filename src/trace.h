@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Request tracing. Spans are timestamped with the TSC and appended to a
+// lock-free ring owned by the recording thread, so a traced request costs a
+// few dozen nanoseconds per span. When tracing is off a span is one branch.
+//
+// Requests are sampled 1-in-N: the request handler asks sampleTrace() once per
+// request and marks its synchronous storage calls with a TraceScope, spans
+// inside them then record for that request only. Loop-level spans (executor,
+// compaction) pass traceEnabled() instead and record whenever tracing is on.
+//
+// The rings keep the most recent events of every thread and are dumped as
+// Chrome trace JSON, viewable in chrome://tracing or Perfetto.
+
+// 0 turns tracing off
+void setTraceSampling(uint32_t one_in);
+uint32_t traceSampling();
+
+inline bool traceEnabled() {
+    return traceSampling() != 0;
+}
+
+// Whether the next request is traced
+bool sampleTrace();
+// Requests sampled on this thread so far
+uint64_t sampledRequests();
+
+// Whether the current thread is inside a TraceScope of a sampled request
+bool traceThisThread();
+
+// Names the calling thread in dumps
+void setTraceThreadName(const std::string &name);
+
+// Marks the current thread as working for a sampled (or not) request. Must
+// not live across a co_await: other coroutines would inherit it
+class TraceScope {
+private:
+    bool previous;
+
+public:
+    explicit TraceScope(bool sampled);
+    ~TraceScope();
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+};
+
+// Records [construction, destruction) under `name`, which must outlive the
+// dump (a string literal). Spans of one thread have to nest; a span that
+// lives across co_await passes a nonzero `async_id` and gets its own track
+class TraceSpan {
+private:
+    const char *name;
+    uint64_t begin = 0;
+    uint64_t async_id;
+    bool record;
+
+public:
+    explicit TraceSpan(const char *name, bool record = traceThisThread(), uint64_t async_id = 0);
+    ~TraceSpan();
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    // For spans whose kind is known only later, e.g. a request after parsing
+    void rename(const char *new_name) {
+        name = new_name;
+    }
+    void discard() {
+        record = false;
+    }
+};
+
+// Writes the rings of all threads as Chrome trace JSON; false on I/O errors
+bool dumpTrace(const std::string &path);
+
+// `trace-<pid>-<time>.json` in the working directory
+std::string traceDumpPath();
+
+// Dumps to a new traceDumpPath() whenever the process gets `signal`. The dump
+// runs on a helper thread, not in the handler
+void installTraceDumpSignal(int signal);
+
+// Has the helper thread of installTraceDumpSignal write a dump to `path`, set
+// here. False, with nothing written, while an earlier request is waiting, less
+// than ten seconds after the last one, or without the helper thread
+bool requestTraceDump(std::string &path);